@@ -0,0 +1,114 @@
+// backend_host.h - the song from a file, for every host player
+//
+// Reads in 256 byte blocks like the ZXpand does.  The loop start's block
+// is kept, going round only seeks to the one after it.  Also the output
+// buffer midiplay's backends write() out.
+
+#include <stdlib.h>
+#include <errno.h>
+
+FILE* midiFile;
+int sdDatIdx = 255;
+uint8_t sdData[256];
+uint32_t sdBlocks = 0;      // blocks up to the one in sdData
+uint32_t sdSize = 0;
+uint32_t sdRead = 0;        // bytes read from the file, and in how many reads
+uint32_t sdRefills = 0;
+
+uint8_t  loopBlock[256];
+uint32_t loopOffset = 0;
+
+#define outsize 4096
+uint8_t  outData[outsize];
+uint32_t outLen = 0;
+
+static inline uint8_t openFile(const char* name)
+{
+  midiFile = fopen(name, "rb");
+  if (!midiFile) {
+    puts("can't open input file.");
+    return 1;
+  }
+  fseek(midiFile, 0, SEEK_END);
+  sdSize = ftell(midiFile);
+  fseek(midiFile, 0, SEEK_SET);
+  return 0;
+}
+
+static inline uint8_t hostOpen(int argc, char** argv)
+{
+  if (argc < 2) {
+    puts("usage: midiplay file.mid");
+    return 1;
+  }
+  return openFile(argv[1]);
+}
+
+static inline void readBlock(void)
+{
+  sdRead += fread(sdData, 1, 256, midiFile);
+  sdRefills++;
+  sdBlocks++;
+}
+
+// length is tracked by midi reader so we don't need to do it here
+static inline uint8_t SDgetc(void)
+{
+  ++sdDatIdx;
+  sdDatIdx &= 255;
+  if (sdDatIdx == 0) readBlock();
+  return sdData[sdDatIdx];
+}
+
+// Offset of the byte the next SDgetc() returns
+static inline uint32_t sdPos(void)
+{
+  return (sdBlocks - 1) * 256 + sdDatIdx + 1;
+}
+
+// Only asked once per chunk, the byte path just counts blocks
+static inline uint32_t SDleft(void)
+{
+  return sdSize - sdPos();
+}
+
+// Make the next SDgetc() return the byte at offset
+static inline void seekFile(uint32_t offset)
+{
+  fseek(midiFile, offset & ~255, SEEK_SET);
+  sdBlocks = offset >> 8;
+  sdDatIdx = (offset - 1) & 255;
+  if (offset & 255) readBlock();
+}
+
+static inline void markSource(void)
+{
+  loopOffset = sdPos();
+  memcpy(loopBlock, sdData, 256);
+}
+
+static inline void rewindSource(void)
+{
+  memcpy(sdData, loopBlock, 256);
+  sdBlocks = ((loopOffset - 1) >> 8) + 1;
+  sdDatIdx = (loopOffset - 1) & 255;
+  fseek(midiFile, sdBlocks * 256, SEEK_SET);
+}
+
+#define dropSource()
+
+static inline void writeOut(void)
+{
+  uint32_t done = 0;
+  while (done < outLen)
+  {
+    ssize_t n = write(1, outData + done, outLen - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      perror("write");
+      exit(1);
+    }
+    done += n;
+  }
+  outLen = 0;
+}
@@ -0,0 +1,37 @@
+// backend_null.h - nothing out, for timing the parser
+//
+// Only counts the bytes, and reports them on stderr with the time taken.
+
+#include <time.h>
+#include "backend_host.h"
+
+uint32_t nullBytes = 0;
+struct timespec nullStart;
+
+static inline uint8_t backendOpen(int argc, char** argv)
+{
+  clock_gettime(CLOCK_MONOTONIC, &nullStart);
+  return hostOpen(argc, argv);
+}
+
+static inline void MidiOut(uint8_t x)
+{
+  (void)x;
+  nullBytes++;
+}
+
+static inline void midiOutBlock(uint8_t* msg)
+{
+  nullBytes += msg[0];
+}
+
+#define flushMidi()
+#define waitUntil(due) 0
+
+static inline void backendClose(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  fprintf(stderr, "%u bytes in %ld us\n", nullBytes,
+    (long)((now.tv_sec - nullStart.tv_sec) * 1000000L + (now.tv_nsec - nullStart.tv_nsec) / 1000));
+}
@@ -0,0 +1,52 @@
+// backend_realtime.h - raw MIDI on stdout, each bucket at its time
+//
+// The core waits until a bucket is due (absolute deadlines on the
+// monotonic clock, so late wakeups don't add up) and it is written in
+// one go.  pcplay -r does the same from its own output thread.
+
+#include <time.h>
+#include "backend_host.h"
+
+#define backendOpen hostOpen
+
+struct timespec startTime;
+uint8_t started = 0;
+
+static inline void MidiOut(uint8_t x)
+{
+  if (outLen == outsize) writeOut();
+  outData[outLen++] = x;
+}
+
+static inline void midiOutBlock(uint8_t* msg)
+{
+  if (outLen + msg[0] > outsize) writeOut();
+  memcpy(outData + outLen, msg + 1, msg[0]);
+  outLen += msg[0];
+}
+
+static inline uint8_t waitUntil(uint32_t due)
+{
+  struct timespec at;
+
+  if (!outLen) return 0;
+  if (!started) {
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+    started = 1;
+  }
+  at.tv_sec = startTime.tv_sec + due / 1000;
+  at.tv_nsec = startTime.tv_nsec + (due % 1000) * 1000000L;
+  if (at.tv_nsec >= 1000000000L) {
+    at.tv_sec++;
+    at.tv_nsec -= 1000000000L;
+  }
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL) == EINTR);
+  return 0;
+}
+
+#define flushMidi() writeOut()
+
+static inline void backendClose(void)
+{
+  writeOut();
+}
@@ -0,0 +1,28 @@
+// backend_stdout.h - raw MIDI on stdout as fast as it is parsed
+//
+// Times are dropped, the buffer is written whenever it fills.
+
+#include "backend_host.h"
+
+#define backendOpen hostOpen
+
+static inline void MidiOut(uint8_t x)
+{
+  if (outLen == outsize) writeOut();
+  outData[outLen++] = x;
+}
+
+static inline void midiOutBlock(uint8_t* msg)
+{
+  if (outLen + msg[0] > outsize) writeOut();
+  memcpy(outData + outLen, msg + 1, msg[0]);
+  outLen += msg[0];
+}
+
+#define flushMidi()
+#define waitUntil(due) 0
+
+static inline void backendClose(void)
+{
+  writeOut();
+}
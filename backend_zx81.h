@@ -0,0 +1,568 @@
+// backend_zx81.h - the ZX81 and ZXpand under midicore.h, for tinymidiplay
+//
+// The song comes from the SD card a 256 byte block at a time, through the
+// MLZ1 decompressor for a packed file, and the MIDI bytes go out through
+// the ZXpand's buffer, one bucket a write.  Everything on the byte path
+// is Z80; the clock and the keys are read here too.  Include before
+// midicore.h.
+
+// MEMORY MAP
+//   $8000 ZXpand command buffer, $8100 the song's "ope fil" for loops
+//   $8200 SD block or MLZ1 window, $8300 MLZ1 input, $8400 playlist
+//   $8800 statusMap, $8900 keyMap, $9000 velMap
+//   $9800 MLZ1 window at the loop start, $9900 loop cache, $a100 text queue
+#define statusMap ((uint8_t*)0x8800)   // status byte to status byte
+#define keyMap ((uint8_t*)0x8900)      // key, +128 for untransposed channels
+#define velMap ((uint8_t*)0x9000)      // 128 velocities per channel
+
+// The one MIDI out, every port plays on it (see playPort)
+#define maxports 1
+#define portLive(p) 1
+#define portSlot(p) 0
+#define bucketcap 256
+
+// The ZXpand doesn't give the player the file length
+#define SDleft() ((uint32_t)0xFFFFFFFF)
+
+// KEYBOARD
+// BREAK stops, P pauses and P again resumes
+#define keyBreak 1
+#define keyPause 2
+
+uint8_t sdDatIdx = 255;
+uint8_t* sdData = (uint8_t*)0x8200;
+
+// Compressed (MLZ1) files, see midipack.c.  The decompressor keeps the
+// last 256 output bytes in the $8200 page as its window and reads the
+// packed data through the $8300 page.
+uint8_t lzOut = 0;      // next write position in the window
+uint8_t lzCount = 0;    // bytes left in the current run
+uint8_t lzSrc = 0;      // window read position of the current match
+uint8_t lzIsMatch = 0;
+
+// LOOP CACHE
+// The block holding the loop start and the next 7 are kept from $9900 as
+// they are read, so a loop of up to 2K replays from RAM and the file is
+// never touched.  A longer loop reopens the file and reads up to the end
+// of the cache, ZXpand can't seek.
+#define loopBlocks 8
+uint16_t sdBlock = 0;       // blocks read from the file so far
+uint8_t  loopRecord = 0;    // blocks still to copy to the cache
+uint8_t  loopReplay = 0;    // blocks still to take from the cache
+uint8_t  loopCached = 0;    // blocks cached after the loop start one
+uint8_t* loopCacheNext;
+uint8_t* loopCache = (uint8_t*)0x9900;
+uint8_t* loopWindow = (uint8_t*)0x9800;  // MLZ1 window at the loop start
+uint8_t* reopenCmd = (uint8_t*)0x8100;   // "ope fil" of the song playing
+uint8_t  packedFile = 0;
+
+struct
+{
+  uint16_t block;
+  uint8_t  sdDatIdx;
+  uint8_t  lzOut, lzCount, lzSrc, lzIsMatch;
+} sourceMark;
+
+// SONG CLOCK
+// FRAMES (16436) counts down once a frame in its low 15 bits.  songMS
+// follows it from the start of the song and each bucket waits for it,
+// the time spent waiting is the player's idle time.  A 60Hz frame is
+// 16ms and 40/60, the sixtieths are carried in clockFrac so the clock
+// keeps exact time.  MARGIN (16424) tells the machines apart, the ROM
+// sets it to 55 blank lines at 50Hz and 31 at 60Hz.
+uint16_t* frames = (uint16_t*)16436;
+uint8_t* margin = (uint8_t*)16424;
+uint8_t  frameHz = 50;
+uint8_t  clockMS = 20;      // whole ms a frame
+uint8_t  clockRest = 0;     // and the rest, in 1/frameHz ms
+uint16_t clockFrac = 0;
+uint16_t lastFrames;
+uint32_t songMS = 0;
+
+// PROFILING
+// Build with -DPROFILE to time the hot paths.  FRAMES is sampled on the
+// way in and out of each section and a frame boundary falling inside
+// counts against it, so over a song the frames add up to the time spent
+// there even though most single calls take less than a frame.  Decoding
+// includes the refills it triggers.  Without PROFILE it all goes away.
+#ifdef PROFILE
+#define profRefill 0
+#define profFlush  1
+#define profDecode 2
+#define profTempo  3
+#define nprof      4
+uint16_t profAt[nprof];
+uint16_t profFrames[nprof];
+uint32_t profCalls[nprof];
+uint32_t profLate = 0;      // worst ms a bucket went out after its time
+
+#define PROF_START(s)  profAt[s] = *frames
+#define PROF_STOP(s)   { profFrames[s] += (profAt[s] - *frames) & 0x7FFF; profCalls[s]++; }
+#define PROF_LATE(due) { if (songMS - (due) > profLate) profLate = songMS - (due); }
+
+void profRefillStart(void) { PROF_START(profRefill); }
+void profRefillEnd(void) { PROF_STOP(profRefill); }
+
+void profReset(void)
+{
+  memset(profFrames, 0, sizeof(profFrames));
+  memset(profCalls, 0, sizeof(profCalls));
+  profLate = 0;
+}
+
+void profReport(void)
+{
+  const char* name[nprof] = { "refill", "flush ", "decode", "tempo " };
+  uint8_t i;
+
+  printf("section   calls  frames\n");
+  for (i=0; i<nprof; i++) printf("%s %7ld %7u\n", name[i], profCalls[i], profFrames[i]);
+  printf("worst late %ld ms\n", profLate);
+}
+#else
+#define PROF_START(s)
+#define PROF_STOP(s)
+#define PROF_LATE(due)
+#endif
+
+// length is tracked by midi reader so we don't need to do it here
+//
+// The first instruction is patched by useCompressed(), plain files pay
+// 10 T-states for the jump.
+uint8_t SDgetc(void) __naked
+{
+    #asm
+    jp    sdgetraw
+
+sdgetraw:
+    ld    hl,$8200
+
+    ld    a,(_sdDatIdx)
+    inc   a
+    ld    (_sdDatIdx),a
+    jr    nz,getdata
+
+    call  sdread
+    xor   a
+
+getdata:
+    ld    h,$82
+    ld    l,a
+    ld    l,(hl)
+    ld    h,0
+    ret
+
+    ; T-states per byte, not counting refills, counted from the
+    ; instruction timings (see midipack.c for how to measure them):
+    ;   raw 114, literal 266, match 234, +135 per literal token, +276 per match token
+sdgetlz:
+    ld    a,(_lzCount)
+    or    a
+    jr    nz,lznext
+
+    call  lzraw               ; token
+    cp    $80
+    jr    c,lzlit
+
+    and   $7f                 ; match of 3..130 bytes
+    add   a,3
+    ld    (_lzCount),a
+    call  lzraw               ; distance, 0 means 256
+    ld    b,a
+    ld    a,(_lzOut)
+    sub   b
+    ld    (_lzSrc),a
+    ld    a,1
+    ld    (_lzIsMatch),a
+    jr    lznext
+
+lzlit:
+    inc   a                   ; literal run of 1..128 bytes
+    ld    (_lzCount),a
+    xor   a
+    ld    (_lzIsMatch),a
+
+lznext:
+    ld    hl,_lzCount
+    dec   (hl)
+    ld    a,(_lzIsMatch)
+    or    a
+    jr    z,lzlitbyte
+
+    ld    a,(_lzSrc)
+    ld    l,a
+    inc   a
+    ld    (_lzSrc),a
+    ld    h,$82
+    ld    a,(hl)
+    jr    lzstore
+
+lzlitbyte:
+    call  lzraw
+
+lzstore:
+    ld    c,a
+    ld    a,(_lzOut)
+    ld    l,a
+    inc   a
+    ld    (_lzOut),a
+    ld    h,$82
+    ld    (hl),c
+    ld    l,c
+    ld    h,0
+    ret
+
+    ; next packed byte in a, refilling the $8300 page every 256 bytes
+lzraw:
+    ld    a,(_sdDatIdx)
+    inc   a
+    ld    (_sdDatIdx),a
+    jr    nz,lzrawget
+
+    ld    hl,$8300
+    call  sdread
+    xor   a
+
+lzrawget:
+    ld    h,$83
+    ld    l,a
+    ld    a,(hl)
+    ret
+
+    ; next 256 byte block of the file to the page at hl.  While a loop is
+    ; replayed the blocks come from the loop cache instead, and while one
+    ; is recorded the blocks read are copied to it.
+sdread:
+    ld    a,(_loopReplay)
+    or    a
+    jr    nz,sdcached
+
+#ifdef PROFILE
+    push  hl
+    call  _profRefillStart
+    pop   hl
+    xor   a
+#endif
+    ld    (16446),a   ; 256 bytes to load
+
+    ld    bc,$e007    ; flush any midi bytes out of the input buffer before we overwrite it
+    ld    a,$c0
+    out   (c),a
+    call  $1ff6 ; wait for it ...
+    ld    bc,$0007
+    ld    a,1
+    out   (c),a
+    call  $1ff6 ; wait for it ...
+
+    ld    a,14        ; 00001110  - read, wait and store
+    ld    (16444),a
+    ld    (16447),hl
+    push  hl
+    call  $1ff4
+
+    ld    hl,(_sdBlock)
+    inc   hl
+    ld    (_sdBlock),hl
+    pop   hl
+#ifdef PROFILE
+    push  hl
+    call  _profRefillEnd
+    pop   hl
+#endif
+
+    ld    a,(_loopRecord)
+    or    a
+    ret   z
+    dec   a
+    ld    (_loopRecord),a
+    ld    de,(_loopCacheNext)
+    ld    bc,256
+    ldir
+    ld    (_loopCacheNext),de
+    ret
+
+sdcached:
+    dec   a
+    ld    (_loopReplay),a
+    ex    de,hl
+    ld    hl,(_loopCacheNext)
+    ld    bc,256
+    ldir
+    ld    (_loopCacheNext),hl
+    ret
+    #endasm
+}
+
+// Read one block to $8200 outside of SDgetc, to skip through the file
+void sdReadBlock(void) __naked
+{
+    #asm
+    ld    hl,$8200
+    jp    sdread
+    #endasm
+}
+
+// Switch SDgetc over to the decompressor.  The block read so far holds
+// packed data, so it moves to the input page and the window starts empty.
+void useCompressed(void) __naked
+{
+    #asm
+    ld    hl,$8200
+    ld    de,$8300
+    ld    bc,256
+    ldir
+
+    ld    hl,sdgetlz
+    ld    (_SDgetc+1),hl
+
+    xor   a
+    ld    (_lzOut),a
+    ld    (_lzCount),a
+    ret
+    #endasm
+}
+
+// 16444 = pr_buff
+
+void cvtcmd(unsigned char* buf)
+{
+	while (*buf)
+	{
+		*buf = ascii_zx(*buf);
+		++buf;
+	}
+  --buf;
+  *buf = (*buf) + 128;
+}
+
+void terminate(unsigned char* name)
+{
+  name[strlen(name)-1] = name[strlen(name)-1] + 128;
+}
+
+unsigned char* zstrend(unsigned char* p)
+{
+  while(*p < 128) {
+    ++p;
+  }
+  return p;
+}
+
+unsigned char* zstrcpy(unsigned char* dest, char* str)
+{
+  int n = strlen(str);
+  strcpy(dest, str);
+  cvtcmd(dest);
+}
+
+int __FASTCALL__ zxpandCommand(unsigned char* cmdbuf)
+{
+  #asm
+  push  hl
+  #endasm
+
+  #asm
+  pop   de
+  call  $1ff2
+  ld    a,(16445)
+  ld    h,0
+  ld    l,a
+  #endasm
+}
+
+void initMidi(void)
+{
+  strcpy(0x8000, "ope mid");
+  cvtcmd(0x8000);
+  zxpandCommand(0x8000);
+  #asm
+  ld    bc,$0007
+  ld    a,1
+  out   (c),a ; prep write
+  #endasm
+}
+
+void MidiOut(uint8_t x)  __z88dk_fastcall __naked
+{
+  #asm
+  ld    bc,$4007
+  out   (c),l
+  ret
+  #endasm
+}
+
+// Send a length prefixed message, hl -> length (1-255), bytes.
+// otir can't be used: the ZXpand takes its command from the high port
+// byte, which otir counts down.  outi drops b before the write, so b
+// starts at $41 and goes back up after every byte; 36 T-states a byte.
+void midiOutBlock(uint8_t* msg)  __z88dk_fastcall __naked
+{
+  #asm
+  ld    e,(hl)
+  inc   hl
+  ld    bc,$4107
+blockloop:
+  outi
+  inc   b
+  dec   e
+  jr    nz,blockloop
+  ret
+  #endasm
+}
+
+void flushMidi() __naked
+{
+  #asm
+  ; send data buffer to serial
+  ld    bc,$e007
+  ld    a,$c0
+  out   (c),a
+
+  ; wait until done
+  call  $1ff6
+
+  ; prep write / reset buffer
+  ld    bc,$0007
+  ld    a,1
+  out   (c),a
+
+  ret
+  #endasm
+}
+
+// Back to the plain SDgetc, and a fresh block read for the next file
+void usePlain(void) __naked
+{
+    #asm
+    ld    hl,sdgetraw
+    ld    (_SDgetc+1),hl
+    ld    a,255
+    ld    (_sdDatIdx),a
+    ret
+    #endasm
+}
+
+// Right after the loopStart marker: the block being read, as it was read,
+// and where the decompressor is
+void markSource(void)
+{
+  sourceMark.block = sdBlock;
+  sourceMark.sdDatIdx = sdDatIdx;
+  sourceMark.lzOut = lzOut;
+  sourceMark.lzCount = lzCount;
+  sourceMark.lzSrc = lzSrc;
+  sourceMark.lzIsMatch = lzIsMatch;
+
+  // a packed file reads its blocks through $8300, the $8200 page is the window
+  memcpy(loopCache, packedFile ? 0x8300 : 0x8200, 256);
+  if (packedFile) memcpy(loopWindow, 0x8200, 256);
+  loopCacheNext = loopCache + 256;
+  loopRecord = loopBlocks - 1;
+  loopCached = 255;
+}
+
+// Back to the loop start, from the cache as far as it goes
+void rewindSource(void)
+{
+  uint16_t extra;
+
+  if (loopCached == 255) {
+    // first time round, the cache is complete
+    loopCached = loopBlocks - 1 - loopRecord;
+    loopRecord = 0;
+  }
+
+  extra = sdBlock - sourceMark.block;
+  if (extra > loopCached) {
+    // read the file again up to the last cached block
+    zxpandCommand(reopenCmd);
+    loopReplay = 0;
+    for (sdBlock=0; sdBlock < sourceMark.block + loopCached; ) sdReadBlock();
+    extra = loopCached;
+  }
+  memcpy(packedFile ? 0x8300 : 0x8200, loopCache, 256);
+  if (packedFile) memcpy(0x8200, loopWindow, 256);
+  loopCacheNext = loopCache + 256;
+  loopReplay = extra;
+
+  sdDatIdx = sourceMark.sdDatIdx;
+  lzOut = sourceMark.lzOut;
+  lzCount = sourceMark.lzCount;
+  lzSrc = sourceMark.lzSrc;
+  lzIsMatch = sourceMark.lzIsMatch;
+}
+
+// Played through, nothing more to record
+void dropSource(void)
+{
+  loopRecord = 0;
+}
+
+void syncClock(uint32_t ms)
+{
+  lastFrames = *frames;
+  songMS = ms;
+  clockFrac = 0;
+}
+
+void tickClock(void)
+{
+  uint16_t now = *frames;
+  uint16_t n = (lastFrames - now) & 0x7FFF;
+
+  lastFrames = now;
+  if (!n) return;
+  songMS += (uint32_t)n * clockMS;
+  if (clockRest) {
+    clockFrac += n * clockRest;
+    if (clockFrac >= frameHz) {
+      songMS += clockFrac / frameHz;
+      clockFrac %= frameHz;
+    }
+  }
+}
+
+// 50 or 60Hz, before the settings so the frame is the default bucket
+void setupClock(void)
+{
+  frameHz = *margin < 43 ? 60 : 50;
+  clockMS = 1000 / frameHz;
+  clockRest = 1000 % frameHz;
+}
+
+// Non zero when BREAK or P is down.  Both are bit 0 of their rows, so
+// one read with both rows selected ($5ffe) covers them: about 70
+// T-states a flush including the call, when nothing is pressed.
+uint8_t keysDown(void) __naked
+{
+  #asm
+  ld    a,$5f
+  in    a,($fe)
+  cpl
+  and   1
+  ld    l,a
+  ld    h,0
+  ret
+  #endasm
+}
+
+// keyBreak and keyPause bits of the keys that are down
+uint8_t readKeys(void) __naked
+{
+  #asm
+  ld    a,$7f         ; SPACE/BREAK row
+  in    a,($fe)
+  cpl
+  and   1
+  ld    l,a
+  ld    a,$df         ; P row
+  in    a,($fe)
+  cpl
+  and   1
+  add   a,a
+  or    l
+  ld    l,a
+  ld    h,0
+  ret
+  #endasm
+}
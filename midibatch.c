@@ -0,0 +1,326 @@
+// midibatch: run the converters over a whole library on every core
+//   gcc -O2 -pthread -o midibatch midibatch.c
+//
+// The job list has one "target input output" a line, # starts a comment:
+//   stream  pcplay -t, the timestamped stream the players send
+//   wav     pcplay -w, rendered with the built in synth
+//   min     midimin
+//   pack    midipack -f, the MLZ1 file for tinymidiplay
+//   json    midinfo -j -e
+//   bin     midinfo -b -e
+// A pool of threads (one per core, or -j) takes the jobs in turn and
+// runs the tool, found next to midibatch or in -d, with its output going
+// straight to "output.part", renamed once the tool succeeds.  Every job
+// done is appended to "joblist.done" at once, and -r skips the ones
+// already there, so a run that crashed or was stopped goes on where it
+// was.  The end report gives files/s and MB/s, then each failure with the
+// parser error its tool exited with.
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+extern char** environ;
+
+// RETURN CODES, as the tools exit with parseExit + code
+enum MIDIerrors
+{
+  NoError        = 0,
+  badFileheader  = 1,
+  badTrackheader = 2,
+  badEvent       = 3,
+  endOfFile      = 4,
+	userStop       = 5
+};
+
+#define parseExit 10
+
+const char* errorNames[] = { "NoError", "badFileheader", "badTrackheader", "badEvent", "endOfFile", "userStop" };
+
+#define maxjobs  65536
+#define maxpath  1024
+#define maxargs  8
+
+// TARGETS
+// The tool and its arguments, "%i" is the input and "%o" the output
+typedef struct
+{
+  const char* name;
+  const char* args[maxargs];
+} TARGET;
+
+const TARGET targets[] =
+{
+  { "stream", { "pcplay", "-t", "-o", "%o", "%i", NULL } },
+  { "wav",    { "pcplay", "-w", "%o", "%i", NULL } },
+  { "min",    { "midimin", "%i", "%o", NULL } },
+  { "pack",   { "midipack", "-f", "%i", "%o", NULL } },
+  { "json",   { "midinfo", "-j", "-e", "-o", "%o", "%i", NULL } },
+  { "bin",    { "midinfo", "-b", "-e", "-o", "%o", "%i", NULL } }
+};
+#define ntargets (sizeof(targets) / sizeof(targets[0]))
+
+typedef struct
+{
+  const TARGET* target;
+  char*    input;
+  char*    output;
+  uint8_t  skip;        // done by an earlier run
+  int      status;      // exit status, -1 when it didn't exit
+  uint64_t bytesIn, bytesOut;
+} JOB;
+
+JOB      jobs[maxjobs];
+uint32_t njobs = 0;
+uint32_t nextJob = 0;
+pthread_mutex_t jobLock = PTHREAD_MUTEX_INITIALIZER;
+
+char  toolDir[maxpath] = ".";
+FILE* doneFile;
+
+// Read the job list, 0 and a message when a line is wrong
+uint8_t readJobs(const char* name)
+{
+  char line[3 * maxpath], target[16], input[maxpath], output[maxpath];
+  uint32_t n = 0;
+  FILE* f = fopen(name, "r");
+
+  if (!f) {
+    puts("can't open job list.");
+    return 0;
+  }
+  while (fgets(line, sizeof(line), f))
+  {
+    uint8_t t;
+    n++;
+    if (sscanf(line, "%15s %1023s %1023s", target, input, output) != 3 || target[0] == '#')
+    {
+      if (sscanf(line, "%15s", target) == 1 && target[0] != '#') {
+        printf("line %u: want target input output.\n", n);
+        fclose(f);
+        return 0;
+      }
+      continue;
+    }
+    for (t=0; t<ntargets && strcmp(targets[t].name, target); t++);
+    if (t == ntargets) {
+      printf("line %u: no target %s.\n", n, target);
+      fclose(f);
+      return 0;
+    }
+    if (njobs == maxjobs) {
+      puts("too many jobs.");
+      fclose(f);
+      return 0;
+    }
+    jobs[njobs].target = &targets[t];
+    jobs[njobs].input = strdup(input);
+    jobs[njobs].output = strdup(output);
+    njobs++;
+  }
+  fclose(f);
+  return 1;
+}
+
+// Mark the jobs whose output is in the done list of an earlier run
+uint32_t skipDone(const char* name)
+{
+  char line[maxpath + 16], output[maxpath];
+  uint32_t skipped = 0;
+  FILE* f = fopen(name, "r");
+
+  if (!f) return 0;
+  while (fgets(line, sizeof(line), f))
+  {
+    if (sscanf(line, "ok %1023s", output) != 1) continue;
+    for (uint32_t i=0; i<njobs; i++)
+    {
+      if (!jobs[i].skip && !strcmp(jobs[i].output, output))
+      {
+        jobs[i].skip = 1;
+        skipped++;
+      }
+    }
+  }
+  fclose(f);
+  return skipped;
+}
+
+uint64_t fileSize(const char* name)
+{
+  struct stat st;
+  return stat(name, &st) ? 0 : st.st_size;
+}
+
+// Run one job's tool with stdout and stderr thrown away, its exit status
+int runJob(JOB* job)
+{
+  char tool[maxpath + 16], part[maxpath + 8];
+  char* argv[maxargs];
+  posix_spawn_file_actions_t actions;
+  pid_t pid;
+  int status, i;
+
+  snprintf(tool, sizeof(tool), "%s/%s", toolDir, job->target->args[0]);
+  snprintf(part, sizeof(part), "%s.part", job->output);
+  argv[0] = tool;
+  for (i=1; job->target->args[i]; i++)
+  {
+    const char* a = job->target->args[i];
+    argv[i] = !strcmp(a, "%i") ? job->input : !strcmp(a, "%o") ? part : (char*)a;
+  }
+  argv[i] = NULL;
+
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+  posix_spawn_file_actions_addopen(&actions, 2, "/dev/null", O_WRONLY, 0);
+  status = posix_spawn(&pid, tool, &actions, NULL, argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (status) return -1;
+
+  // only a signal is worth waiting again for, ECHILD or anything else
+  // fails the job
+  while (waitpid(pid, &status, 0) < 0)
+  {
+    if (errno != EINTR) {
+      unlink(part);
+      return -1;
+    }
+  }
+  if (!WIFEXITED(status)) return -1;
+  status = WEXITSTATUS(status);
+
+  if (!status && rename(part, job->output)) status = -1;
+  if (status) unlink(part);
+  return status;
+}
+
+void* worker(void* arg)
+{
+  (void)arg;
+
+  for (;;)
+  {
+    JOB* job;
+
+    pthread_mutex_lock(&jobLock);
+    while (nextJob < njobs && jobs[nextJob].skip) nextJob++;
+    job = nextJob < njobs ? &jobs[nextJob++] : NULL;
+    pthread_mutex_unlock(&jobLock);
+    if (!job) return NULL;
+
+    job->bytesIn = fileSize(job->input);
+    job->status = runJob(job);
+    if (!job->status) job->bytesOut = fileSize(job->output);
+
+    // on disk before the next job starts, a crash loses at most the
+    // jobs running at the time
+    pthread_mutex_lock(&jobLock);
+    fprintf(doneFile, "%s %s\n", job->status ? "fail" : "ok", job->output);
+    fflush(doneFile);
+    fsync(fileno(doneFile));
+    pthread_mutex_unlock(&jobLock);
+  }
+}
+
+void printFailure(JOB* job)
+{
+  int code = job->status - parseExit;
+
+  printf("FAIL %s %s: ", job->target->name, job->input);
+  if (job->status < 0) puts("did not run to the end");
+  else if (code > 0 && code <= userStop) printf("%s (exit %d)\n", errorNames[code], job->status);
+  else printf("exit %d\n", job->status);
+}
+
+int usage(void)
+{
+  puts("usage: midibatch [-j threads] [-r] [-d dir] joblist");
+  puts("  -j  number of jobs at once, one per core by default");
+  puts("  -r  resume, skip the jobs joblist.done has as ok");
+  puts("  -d  directory of pcplay, midimin, midipack and midinfo");
+  puts("  targets: stream wav min pack json bin");
+  return 1;
+}
+
+int main(int argc, char** argv)
+{
+  int opt;
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  uint8_t resume = 0, ownDir = 0;
+  uint32_t skipped = 0, done = 0, failed = 0;
+  uint64_t bytesIn = 0, bytesOut = 0;
+  char doneName[maxpath + 8];
+  pthread_t* pool;
+  struct timespec start, end;
+  double took;
+
+  while ((opt = getopt(argc, argv, "j:rd:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'j': threads = atoi(optarg); break;
+      case 'r': resume = 1; break;
+      case 'd': snprintf(toolDir, sizeof(toolDir), "%s", optarg); ownDir = 1; break;
+      default: return usage();
+    }
+  }
+  if (optind + 1 != argc || threads < 1) return usage();
+
+  // the tools are next to midibatch unless -d says
+  if (!ownDir && strrchr(argv[0], '/'))
+  {
+    snprintf(toolDir, sizeof(toolDir), "%.*s", (int)(strrchr(argv[0], '/') - argv[0]), argv[0]);
+  }
+
+  if (!readJobs(argv[optind])) return 1;
+  snprintf(doneName, sizeof(doneName), "%s.done", argv[optind]);
+  if (resume) skipped = skipDone(doneName);
+  doneFile = fopen(doneName, resume ? "a" : "w");
+  if (!doneFile) {
+    puts("can't open done list.");
+    return 1;
+  }
+
+  if (threads > njobs - skipped) threads = njobs - skipped ? njobs - skipped : 1;
+  pool = malloc(threads * sizeof(pthread_t));
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (long i=0; i<threads; i++)
+  {
+    if (pthread_create(&pool[i], NULL, worker, NULL)) {
+      puts("can't start worker thread.");
+      return 1;
+    }
+  }
+  for (long i=0; i<threads; i++) pthread_join(pool[i], NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  fclose(doneFile);
+
+  for (uint32_t i=0; i<njobs; i++)
+  {
+    if (jobs[i].skip) continue;
+    done++;
+    bytesIn += jobs[i].bytesIn;
+    bytesOut += jobs[i].bytesOut;
+    if (jobs[i].status) failed++;
+  }
+
+  took = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("%u jobs, %u done before, %u failed, %ld threads\n", njobs, skipped, failed, threads);
+  printf("%.3f s, %.1f files/s, %.2f MB/s in, %.2f MB/s out\n", took,
+    took > 0 ? done / took : 0, took > 0 ? bytesIn / took / 1e6 : 0, took > 0 ? bytesOut / took / 1e6 : 0);
+  for (uint32_t i=0; i<njobs; i++)
+  {
+    if (!jobs[i].skip && jobs[i].status) printFailure(&jobs[i]);
+  }
+  return failed ? 2 : 0;
+}
@@ -0,0 +1,258 @@
+// midicheck: fast structural check of MIDI files before they are played
+//   gcc -O2 -o midicheck midicheck.c
+//
+// The file is read into memory in one go and only its framing is walked:
+// chunk headers, delta times, status and data bytes, meta and SysEx
+// lengths.  Nothing is interpreted, so it runs at about memory speed.
+// The first thing wrong is printed with its offset, and the exit status
+// is parseExit + the parser error it maps to, as with the other tools:
+//   badFileheader   no MThd, a header length other than 6, format over 2,
+//                   format 0 with more than one track, division 0
+//   badTrackheader  a chunk other than MTrk where a track should be,
+//                   fewer tracks than the header says
+//   badEvent        a number over 4 bytes, a data byte with the top bit
+//                   set, running status with no status before it, a
+//                   system message (F1-F6, F8-FE) as a status, a SysEx
+//                   packet the players would frame wrongly (see below)
+//   endOfFile       a chunk, an event or a length running past its chunk
+//                   or the end of the file
+// The players read every track to the end of its chunk, End of Track or
+// not, so the events must fill the chunk exactly and whatever follows an
+// End of Track is checked too.  Bytes after the last track are left
+// alone, the players never read them.
+// The players read a SysEx (F0 or F7) up to the first F7, its length
+// bytes included, so a packet has to end in F7 and have no F7 before
+// that.  Split SysEx and F7 escapes without one are rejected: played,
+// they would swallow the events after them.
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// RETURN CODES
+enum MIDIerrors
+{
+  NoError        = 0,
+  badFileheader  = 1,
+  badTrackheader = 2,
+  badEvent       = 3,
+  endOfFile      = 4,
+	userStop       = 5
+};
+
+#define parseExit 10
+
+const char* errorNames[] = { "NoError", "badFileheader", "badTrackheader", "badEvent", "endOfFile", "userStop" };
+
+typedef struct
+{
+  uint8_t     err;
+  uint32_t    offset;     // of the first byte that is wrong
+  const char* what;
+  uint16_t    tracks;
+  uint32_t    events;
+} CHECK;
+
+CHECK check;
+
+uint8_t fail(uint32_t offset, uint8_t err, const char* what)
+{
+  check.offset = offset;
+  check.err = err;
+  check.what = what;
+  return err;
+}
+
+static inline uint32_t be32(const uint8_t* p)
+{
+  return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+// A variable length number at *pos, at most 4 bytes and inside the chunk
+static inline uint8_t checkVLQ(const uint8_t* d, uint32_t* pos, uint32_t end, uint32_t* value)
+{
+  uint32_t p = *pos, v = 0;
+  uint8_t n = 0;
+
+  do
+  {
+    if (p == end) return fail(p, endOfFile, "number runs past the end of the chunk");
+    if (++n > 4) return fail(*pos, badEvent, "number longer than 4 bytes");
+    v = (v << 7) | (d[p] & 0x7F);
+  } while (d[p++] & 0x80);
+
+  *pos = p;
+  *value = v;
+  return NoError;
+}
+
+// The events of one MTrk, from pos up to end
+uint8_t checkTrack(const uint8_t* d, uint32_t pos, uint32_t end)
+{
+  uint8_t running = 0;
+  uint32_t len;
+
+  while (pos < end)
+  {
+    uint8_t status;
+
+    if (checkVLQ(d, &pos, end, &len)) return check.err;
+    if (pos == end) return fail(pos, endOfFile, "delta time without an event");
+
+    status = d[pos];
+    if (status < 0x80)
+    {
+      // running status, the data starts here
+      if (!running) return fail(pos, badEvent, "running status with no status before it");
+      status = running;
+    }
+    else pos++;
+    check.events++;
+
+    if (status < 0xF0)
+    {
+      uint32_t n = (status & 0xE0) == 0xC0 ? 1 : 2;
+      if (end - pos < n) return fail(pos, endOfFile, "channel message runs past the end of the chunk");
+      if ((d[pos] | d[pos + n - 1]) & 0x80) return fail(d[pos] & 0x80 ? pos : pos + 1, badEvent, "data byte with the top bit set");
+      running = status;
+      pos += n;
+    }
+    else if (status == 0xFF)
+    {
+      if (pos == end) return fail(pos, endOfFile, "meta event without a type");
+      pos++;
+      if (checkVLQ(d, &pos, end, &len)) return check.err;
+      if (len > end - pos) return fail(pos, endOfFile, "meta data runs past the end of the chunk");
+      pos += len;
+    }
+    else if (status == 0xF0 || status == 0xF7)
+    {
+      const uint8_t* f7;
+      uint32_t start = pos;
+
+      if (checkVLQ(d, &pos, end, &len)) return check.err;
+      if (len > end - pos) return fail(pos, endOfFile, "SysEx data runs past the end of the chunk");
+      if (!len || d[pos + len - 1] != 0xF7) return fail(len ? pos + len - 1 : pos, badEvent, "SysEx packet not ending in F7");
+      f7 = memchr(d + start, 0xF7, pos + len - 1 - start);
+      if (f7) return fail(f7 - d, badEvent, "F7 inside a SysEx packet");
+      pos += len;
+    }
+    else return fail(pos - 1, badEvent, "system message as a status byte");
+  }
+  return NoError;
+}
+
+uint8_t checkMidi(const uint8_t* d, uint32_t size)
+{
+  uint32_t pos, len;
+  uint16_t format, ntracks;
+
+  memset(&check, 0, sizeof(check));
+
+  if (size < 14) return fail(size, endOfFile, "shorter than a header chunk");
+  if (memcmp(d, "MThd", 4)) return fail(0, badFileheader, "no MThd");
+  if (be32(d + 4) != 6) return fail(4, badFileheader, "header length not 6");
+  format = d[8] << 8 | d[9];
+  ntracks = d[10] << 8 | d[11];
+  if (format > 2) return fail(8, badFileheader, "format over 2");
+  if (format == 0 && ntracks != 1) return fail(10, badFileheader, "format 0 with other than one track");
+  if (!(d[12] | d[13])) return fail(12, badFileheader, "division 0");
+
+  pos = 14;
+  while (check.tracks < ntracks)
+  {
+    if (size - pos < 8) return fail(pos, pos == size ? badTrackheader : endOfFile, pos == size ? "fewer tracks than the header says" : "chunk header cut short");
+    if (memcmp(d + pos, "MTrk", 4)) return fail(pos, badTrackheader, "not an MTrk chunk");
+    len = be32(d + pos + 4);
+    if (len > size - pos - 8) return fail(pos + 4, endOfFile, "track runs past the end of the file");
+    check.tracks++;
+    if (checkTrack(d, pos + 8, pos + 8 + len)) return check.err;
+    pos += 8 + len;
+  }
+  return NoError;
+}
+
+uint8_t* loadFile(const char* name, uint32_t* size)
+{
+  FILE* f = fopen(name, "rb");
+  uint8_t* data;
+  long n;
+
+  if (!f) return NULL;
+  fseek(f, 0, SEEK_END);
+  n = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  data = malloc(n + 1);
+  if (!data || fread(data, 1, n, f) != (size_t)n) {
+    free(data);
+    fclose(f);
+    return NULL;
+  }
+  fclose(f);
+  *size = n;
+  return data;
+}
+
+int usage(void)
+{
+  puts("usage: midicheck [-q] [-s] file.mid...");
+  puts("  -q  no output, only the exit status");
+  puts("  -s  time taken and MB/s of the checks on stderr");
+  return 1;
+}
+
+int main(int argc, char** argv)
+{
+  int opt, status = 0;
+  uint8_t quiet = 0, speed = 0;
+  uint64_t total = 0, ns = 0;
+
+  while ((opt = getopt(argc, argv, "qs")) != -1)
+  {
+    switch (opt)
+    {
+      case 'q': quiet = 1; break;
+      case 's': speed = 1; break;
+      default: return usage();
+    }
+  }
+  if (optind >= argc) return usage();
+
+  for (int i=optind; i<argc; i++)
+  {
+    struct timespec t0, t1;
+    uint32_t size;
+    uint8_t err;
+    uint8_t* data = loadFile(argv[i], &size);
+
+    if (!data) {
+      if (!quiet) printf("%s: can't open input file.\n", argv[i]);
+      if (!status) status = 1;
+      continue;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    err = checkMidi(data, size);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ns += (t1.tv_sec - t0.tv_sec) * 1000000000LL + (t1.tv_nsec - t0.tv_nsec);
+    total += size;
+    free(data);
+
+    if (err)
+    {
+      if (!quiet) printf("%s: offset %u (0x%X): %s, %s\n", argv[i], check.offset, check.offset, check.what, errorNames[err]);
+      if (status == 0 || status == 1) status = parseExit + err;
+    }
+    else if (!quiet) printf("%s: ok, %u tracks, %u events\n", argv[i], check.tracks, check.events);
+  }
+
+  if (speed)
+  {
+    fprintf(stderr, "%llu bytes in %llu us, %.0f MB/s\n", (unsigned long long)total,
+      (unsigned long long)(ns / 1000), ns ? total * 1000.0 / ns : 0);
+  }
+  return status;
+}
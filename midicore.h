@@ -0,0 +1,1045 @@
+// midicore.h - the player core: the SMF parser, transforms, ports, active
+// notes, loop points and the event loop, for tinymidiplay, pcplay and
+// midiplay alike
+//
+// Header only, built into each player against one backend picked at
+// compile time.  Everything the core calls is declared before this is
+// included, as a macro, a static inline function or an asm routine, so
+// every call is direct and the ZX81 build pays no indirection:
+//
+//   maxports                       outputs, 1 when there is a single link
+//   portLive(p)                    non zero when output p is open
+//   portSlot(p)                    output MIDI Port p plays on
+//   bucketcap                      most bytes a bucket may hold
+//   uint8_t  SDgetc(void)          next byte of the song
+//   uint32_t SDleft(void)          bytes of the file not read yet
+//   void     markSource(void)      keep the read position of a loop start
+//   void     rewindSource(void)    go back to it
+//   void     dropSource(void)      the loop is over
+//   void     MidiOut(uint8_t x)    queue one byte for outPort
+//   void     midiOutBlock(uint8_t* msg)  the same for a length prefixed message
+//   void     flushMidi(void)       send what is queued, it is due at millis
+//   uint8_t  waitUntil(uint32_t due)  wait for song time due, non zero to stop
+//   uint8_t  stopKeys(void)        after each bucket is sent, non zero to stop
+//   uint8_t  timeUp(void)          once an event's time is known, non zero to stop
+//   void     textEvent(void)       the lyric or marker in midievent, due at nextTime
+//
+// A backend that places the transform tables itself defines statusMap,
+// keyMap and velMap, and PROF_START, PROF_STOP and PROF_LATE time the
+// sections when it has a profiler.  Include after <stdint.h> and
+// <string.h>.
+
+#ifndef MIDICORE_H
+#define MIDICORE_H
+
+// Controller
+#define MF_Bank_Select_MSB    0x00	// 0x00 .Bank Select MSB (value 0x50 : Preset A Patch 1..128, 0x51 Preset B Patch 129..255)
+#define MF_Bank_Select_LSB    0x20	// 0x20 .Bank Select LSB (value 0x00)
+#define MF_Modulation         0x01	// 0x01 .Modulation
+#define MF_Breath             0x02	// 0x02  Breath Controller
+#define MF_Foot               0x04	// 0x04  Foot Controller
+#define MF_Portamento_Time    0x05	// 0x05 .Portamento Time
+#define MF_Main_Volume        0x07	// 0x07 .Main Volume
+#define MF_Balance            0x08	// 0x08  Balance
+#define MF_Pan                0x0A	// 0x0A .Pan
+#define MF_Expression         0x0B	// 0x0B .Expression Controller
+#define MF_Effect_1           0x0C	// 0x0C  Effect Control 1
+#define MF_Effect_2           0x0D	// 0x0D  Effect Control 2
+#define MF_General_1to4       0x13	// 0x13  General-Purpose Controllers 1-4
+#define MF_Controller_LSB     0x3F	// 0x3F  LSB for controllers 0-31
+#define MF_Sustain            0x40	// 0x40 .Sustain(Damper pedal / Hold 1)
+#define MF_Portamento         0x41	// 0x41 .Portamento
+#define MF_Sostenuto          0x42	// 0x42 .Sostenuto
+#define MF_Soft               0x43	// 0x43 .Soft Pedal
+#define MF_Legato             0x44	// 0x44  Legato Footswitch
+#define MF_Hold               0x45	// 0x45  Hold 2
+#define MF_Control_1          0x46	// 0x46  Sound Controller 1 (default: Timber Variation)
+#define MF_Control_2          0x47	// 0x47  Sound Controller 2 (default: Timber/Harmonic Content)
+#define MF_Control_3          0x48	// 0x48  Sound Controller 3 (default: Release Time)
+#define MF_Control_4          0x49	// 0x49  Sound Controller 4 (default: Attack Time)
+#define MF_Portamento_Ctrl    0x54	// 0x54  Portamento Control
+#define MF_Reverb             0x5B	// 0x5B .Effects 1 Depth (M-GS64 : Reverb send level)
+#define MF_Effects_2          0x5C	// 0x5C  Effects 2 Depth (formerly Tremolo Depth)
+#define MF_Chorus             0x5D	// 0x5D .Effects 3 Depth (M-GS64 : Chorus send level)
+#define MF_Effects_4          0x5E	// 0x5E  Effects 4 Depth (formerly Celeste Detune)
+#define MF_Effects_5          0x5F	// 0x5F  Effects 5 Depth (formerly Phaser Depth)
+#define MF_Data_Increment     0x60	// 0x60  Data Increment
+#define MF_Data_Decrement     0x61	// 0x61  Data Decrement
+#define MF_NRPN_LSB           0x62	// 0x62 .Non-Registered Parameter Number (LSB)
+#define MF_NRPN_MSB           0x63	// 0x63 .Non-Registered Parameter Number (MSB)
+#define MF_RPN_LSB            0x64	// 0x64 .Registered Parameter Number (LSB)
+#define MF_RPN_MSB            0x65	// 0x65 .Registered Parameter Number (MSB)
+#define MF_Mode_Message       0x7F	// 0x7F  Mode Messages
+#define MF_Data_Entry_MSB     0x06	// 0x06  Data Entry (MSB)
+#define MF_Data_Entry_LSB     0x26	// 0x26  Data Entry (LSB)
+
+// MIDI File Formats
+#define MF_Single_track       0x00
+#define MF_Parallel_tracks    0x01
+#define MF_Sequential_tracks  0x02
+
+// Meta Events Type
+#define MF_Meta_Sequence         0x00  // Sequence number
+#define MF_Meta_Text             0x01  // Text event
+#define MF_Meta_Copyright        0x02  // Copyright
+#define MF_Meta_Track_name       0x03  // track name
+#define MF_Meta_Instrument_name  0x04  // Instrument name
+#define MF_Meta_Lyric            0x05  // Lyric text
+#define MF_Meta_Marker           0x06  // Marker text
+#define MF_Meta_Cue_point        0x07  // Cue point
+#define MF_Meta_MIDI_channel     0x20  // MIDI channel
+#define MF_Meta_MIDI_Port        0x21  // MIDI Port
+#define MF_Meta_Track_End        0x2F  // End of track
+#define MF_Meta_Tempo            0x51  // tempo setting
+#define MF_Meta_SMPTE_offset     0x54  // SMPTE offset
+#define MF_Meta_Time_signature   0x58  // Time signature
+#define MF_Meta_Key_signature    0x59  // Key signature
+#define MF_Meta_Special          0x7F  // Seq. special
+
+// FILE header INFORMATION
+typedef struct
+{
+  uint8_t  chk[4];
+  uint32_t length;
+  uint16_t format;
+  uint16_t ntracks;
+  uint16_t division;
+} MTHD;
+
+// TRACK INFORMATION
+typedef struct
+{
+  uint8_t  chk[4];
+  uint32_t length;
+} MTRK;
+
+// EVENT INFORMATION
+#define maxdata 128
+// len, event and data[] are laid out as one length prefixed message
+// so a whole event goes out with a single midiOutBlock() call
+typedef struct
+{
+  uint32_t wait;
+  uint8_t  mtype; // only for Meta Events
+  uint16_t nbdata; // a longer meta says 0xFFFF, only maxdata bytes are kept
+  uint8_t  len;
+  uint8_t  event;
+  uint8_t  data[maxdata];
+} MTEV;
+
+// RETURN CODES
+enum MIDIerrors
+{
+  NoError        = 0,
+  badFileheader  = 1,
+  badTrackheader = 2,
+  badEvent       = 3,
+  endOfFile      = 4,
+  userStop       = 5
+};
+
+// A file that doesn't parse exits with parseExit + its code, clear of the
+// 1 for usage and I/O errors, so a batch run can tell which it was
+#define parseExit 10
+
+#ifndef PROF_START
+#define PROF_START(s)
+#define PROF_STOP(s)
+#define PROF_LATE(due)
+#endif
+
+// The host players count with midistats.h
+#ifndef MIDISTATS_H
+#define statVLQ(bytes)
+#define statEvent(status, mtype, nbdata)
+#define statRunning()
+#endif
+
+// FUNCTIONS
+uint16_t read16(void);
+uint32_t read32(void);
+uint32_t readVariableLength(void);
+void     readNdata(uint8_t start);
+void     readMeta(uint32_t len);
+uint32_t trackPos(void);
+uint8_t  readHeaderChunk(void);
+uint8_t  readTrackChunk(void);
+uint8_t  readTrackEvent(void);
+void     setTempo(uint32_t t);
+uint32_t waitMS(uint32_t wait);
+void     buildTransforms(void);
+void     allSoundOff(void);
+void     releaseNotes(void);
+void     stopNotes(void);
+void     restoreControllers(void);
+void     flushBucket(void);
+uint8_t  sendBucket(void);
+void     resetSong(void);
+uint8_t  playTrack(void);
+uint8_t  playTracks(void);
+
+// Position in track
+// A track under 64KB, nearly all of them, counts in 16 bits: tpos16 up
+// to tlen16 (less 16 bytes, see readTrackChunk).  Only a longer one sets
+// longTrack and moves the 32 bit tpos.  The bytes of an event are counted
+// in 8 bits in evBytes and added to the position once, at the end of the
+// event.
+uint32_t tpos      = 0;
+uint16_t tpos16    = 0;
+uint16_t tlen16    = 0;
+uint8_t  longTrack = 0;
+uint8_t  evBytes   = 0;
+
+// LAST EVENT READ
+uint8_t runningEvent = 0;
+
+// TEMPO (microsec/beat)
+uint32_t tempo = 500000;
+uint32_t scaledTempo = 500000;        // tempo divided by the speed
+uint32_t usTick = 5208;               // scaledTempo / division
+uint32_t usRest = 32;                 // and the rest, in 1/division us
+
+// Shared variables
+MTHD midiheader;
+MTRK miditrack;
+MTEV midievent;
+
+uint32_t millis = 0;                  // song time of the bucket being filled
+uint32_t nextTime = 0;                // song time of the last event read
+uint16_t curTrack = 0;
+
+// BUCKETS
+// Events are sent in buckets of frameMS, each when the song reaches its
+// first event: one ZXpand buffer write on the ZX81, one write() a port
+// on the host.  frameMS 0 sends every time change on its own.  A bucket
+// is also sent early before it holds more than bucketcap bytes.
+uint16_t frameMS = 0;
+uint32_t bucketEnd = 1;
+uint16_t bucketBytes = 0;
+
+// PORTS
+// A MIDI Port meta (0x21) sends the rest of its track to that port, or
+// only the channel of a MIDI Channel meta (0x20) just before.  playPort
+// 255 plays every port, each on the output portSlot() gives it; any
+// other plays only that port.
+uint8_t  playPort = 255;
+uint8_t  trackPort[16];               // port of each channel in this track
+uint8_t  sysexPort = 0;               // port of the track's SysEx
+uint8_t  channelPrefix = 255;
+uint8_t  outPort = 0;                 // output MidiOut() fills
+
+// A single link indexes its state with a constant
+#if maxports == 1
+#define outSlot 0
+#else
+#define outSlot outPort
+#endif
+
+// ACTIVE NOTES
+// One bit per output, channel and key, and the channels holding the
+// sustain pedal, kept up to date from what is sent, so a stop only sends
+// note offs for what is sounding.  stopPanic follows them with the 96
+// byte panic anyway.
+uint8_t  activeNotes[maxports][16*16];
+uint16_t sustainHeld[maxports];
+uint8_t  stopPanic = 0;
+uint16_t stopBytes = 0;
+
+const uint8_t keyBit[8] = { 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80 };
+
+// CHANNEL STATE
+// Controllers, program and bend sent so far on each output, put back
+// after a pause and when a loop goes round.  0xFF is unset, MIDI data
+// bytes never have the top bit set.
+#define nctrl 5
+const uint8_t ctrlNumber[nctrl] = { MF_Modulation, MF_Main_Volume, MF_Pan, MF_Expression, MF_Sustain };
+
+typedef struct
+{
+  uint8_t ctrl[16][nctrl];
+  uint8_t program[16];
+  uint8_t bend[16][2];
+} CHANSTATE;
+
+CHANSTATE chanState[maxports];
+
+// TRANSFORMS
+// Set by each player's options, buildTransforms() turns them into lookup
+// tables once so the output path is a few table reads per event, or a
+// single test when they are all left alone.
+uint16_t speedPercent = 100;          // 50 plays at half speed, 200 at double
+int8_t   transpose = 0;               // semitones
+uint16_t noTranspose = 1 << 9;        // channels left alone, drums on 10
+uint8_t  chanRemap[16] = { 0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15 };
+uint8_t  velPercent[16] = { 100,100,100,100,100,100,100,100,100,100,100,100,100,100,100,100 };
+uint8_t  transforms = 0;
+
+#ifndef statusMap
+uint8_t  statusMap[256];              // status byte to status byte
+uint8_t  keyMap[256];                 // key, +128 for untransposed channels
+uint8_t  velMap[16*128];              // 128 velocities per channel
+#endif
+uint8_t  keySkip[16];                 // 0 or 128, the keyMap half to use
+
+// LOOP POINTS
+// A "loopStart" marker saves the parser and channel state and a "loopEnd"
+// marker in the same track goes back to it loopPasses times, 255 forever,
+// then plays on.  The backend keeps the read position (markSource).
+uint8_t  loopPasses = 0;
+uint8_t  loopsLeft = 0;
+uint8_t  loopSet = 0;
+
+typedef struct
+{
+  uint16_t  track;
+  uint32_t  tpos;
+  uint8_t   runningEvent;
+  uint32_t  tempo;
+  CHANSTATE chan[maxports];
+} LOOPSTATE;
+
+LOOPSTATE loopState;
+
+
+// Both the Z80 and the hosts are little endian
+union {
+  uint8_t  parts[4];
+  uint32_t whole32;
+  uint16_t whole16;
+} longval;
+
+
+// Read a 16 bits integer
+uint16_t read16(void)
+{
+  longval.parts[1] = SDgetc();
+  longval.parts[0] = SDgetc();
+  return longval.whole16;
+}
+
+
+// Read a 32 bits integer
+uint32_t read32(void)
+{
+  longval.parts[3] = SDgetc();
+  longval.parts[2] = SDgetc();
+  longval.parts[1] = SDgetc();
+  longval.parts[0] = SDgetc();
+  return longval.whole32;
+}
+
+
+// Read a MIDI "variable length" integer, 4 bytes at most as the spec says
+// so a broken length can't run on through the song
+uint32_t readVariableLength(void)
+{
+  uint32_t v;
+  uint8_t c;
+  uint8_t n = 1;
+
+  c = SDgetc();
+  v = c & 0x7F;
+  while ((c & 0x80) && n < 4)
+  {
+    c = SDgetc();
+    v = (v << 7) | (c & 0x7F);
+    n++;
+  }
+  evBytes += n;
+  statVLQ(n);
+  return v;
+}
+
+
+// Read the data bytes of a channel message, "midievent.nbdata" is 1 or 2,
+// in "midievent.data[]" starting at "midievent.data[start]"
+void readNdata(uint8_t start)
+{
+  uint8_t i;
+  for (i=start; i<(uint8_t)midievent.nbdata; i++)
+  {
+    midievent.data[i] = SDgetc();
+  }
+  evBytes += i - start;
+}
+
+
+// Position in the track, for the loop and the progress bar
+uint32_t trackPos(void)
+{
+  return longTrack ? tpos : tpos16;
+}
+
+
+// Bytes of the track after the ones read, the event's own included.
+// Only metas and SysEx ask, so it can be 32 bits
+uint32_t trackLeft(void)
+{
+  uint32_t at = trackPos() + evBytes;
+  return at < miditrack.length ? miditrack.length - at : 0;
+}
+
+
+// Move the track position on by the data of a meta or SysEx event
+void trackSkip(uint32_t n)
+{
+  if (longTrack) tpos += n;
+  else tpos16 += (uint16_t)n;
+}
+
+
+// Read "len" bytes of meta data, only the first "maxdata" are kept
+void readMeta(uint32_t len)
+{
+  uint8_t i;
+  midievent.nbdata = len < 0xFFFF ? len : 0xFFFF;
+  trackSkip(len);
+  for (i=0; i<maxdata && len; i++, len--) midievent.data[i] = SDgetc();
+  while (len--) SDgetc();
+}
+
+
+// The speed and the division are applied here, once per tempo change
+void setTempo(uint32_t t)
+{
+  tempo = t;
+  scaledTempo = tempo * 100 / speedPercent;
+  usTick = scaledTempo / midiheader.division;
+  usRest = scaledTempo % midiheader.division;
+}
+
+
+// wait * scaledTempo / division / 1000 in 32 bits, the speed can make
+// the single product overflow on a rest of a few bars: whole us per tick,
+// then the rest once per division of the wait and once for what is left
+// of it, each product under 2^30.  Exact while the wait is under 71
+// minutes, and nothing to do for the many events with no wait.
+uint32_t waitMS(uint32_t wait)
+{
+  uint32_t us;
+
+  if (!wait) return 0;
+  us = wait * usTick;
+  if (wait >= midiheader.division)
+  {
+    us += wait / midiheader.division * usRest;
+    wait %= midiheader.division;
+  }
+  return (us + wait * usRest / midiheader.division) / 1000;
+}
+
+
+// Fill the transform tables from the settings, and note whether any of
+// them does anything
+void buildTransforms(void)
+{
+  uint16_t i;
+  int16_t v;
+
+  // the speed needs no table, it is folded into scaledTempo
+  if (!speedPercent) speedPercent = 100;
+  transforms = transpose != 0;
+
+  for (i=0; i<256; i++)
+  {
+    statusMap[i] = i;
+    keyMap[i] = i & 0x7F;
+  }
+  for (i=0; i<16; i++)
+  {
+    if (chanRemap[i] != i || velPercent[i] != 100) transforms = 1;
+    keySkip[i] = noTranspose & (1 << i) ? 128 : 0;
+  }
+  for (i=0x80; i<0xF0; i++) statusMap[i] = (i & 0xF0) | (chanRemap[i & 0x0F] & 0x0F);
+  for (i=0; i<128; i++)
+  {
+    v = i + transpose;
+    keyMap[i] = v < 0 ? 0 : v > 127 ? 127 : v;
+  }
+  for (i=0; i<16*128; i++)
+  {
+    // velocity 0 stays a note off, anything else stays a note on
+    v = i & 0x7F;
+    if (v)
+    {
+      v = (v * velPercent[i >> 7]) / 100;
+      v = v < 1 ? 1 : v > 127 ? 127 : v;
+    }
+    velMap[i] = v;
+  }
+}
+
+
+// Remap, transpose and scale the channel message in midievent before it
+// is sent, so everything downstream sees what the synth heard
+void applyTransforms(void)
+{
+  uint8_t channel = midievent.event & 0x0F;
+
+  switch (midievent.event & 0xF0)
+  {
+    case 0x90:
+      midievent.data[1] = velMap[(channel << 7) | (midievent.data[1] & 0x7F)];
+      // fall through
+    case 0x80:
+    case 0xA0:
+      midievent.data[0] = keyMap[keySkip[channel] | (midievent.data[0] & 0x7F)];
+      break;
+  }
+  midievent.event = statusMap[midievent.event];
+}
+
+
+// MIDI Port and MIDI Channel metas
+void portMeta(void)
+{
+  if (midievent.nbdata != 1) return;
+
+  if (midievent.mtype == MF_Meta_MIDI_channel)
+  {
+    channelPrefix = midievent.data[0] & 0x0F;
+  }
+  else if (channelPrefix != 255)
+  {
+    trackPort[channelPrefix] = midievent.data[0];
+  }
+  else
+  {
+    sysexPort = midievent.data[0];
+    memset(trackPort, sysexPort, sizeof(trackPort));
+  }
+}
+
+// every track starts on port 0
+void resetPorts(void)
+{
+  memset(trackPort, 0, sizeof(trackPort));
+  sysexPort = 0;
+  channelPrefix = 255;
+}
+
+// The port the event in midievent goes to
+uint8_t eventPort(void)
+{
+  if (midievent.event < 0xF0)
+  {
+    channelPrefix = 255;
+    return trackPort[midievent.event & 0x0F];
+  }
+  return channelPrefix != 255 ? trackPort[channelPrefix] : sysexPort;
+}
+
+
+// Send what is queued now, without waiting for its time
+void flushBucket(void)
+{
+  flushMidi();
+  bucketBytes = 0;
+}
+
+// Wait for the time of the bucket being filled and send it; non zero
+// means stop
+uint8_t sendBucket(void)
+{
+  if (waitUntil(millis)) return 1;
+  PROF_LATE(millis);
+  PROF_START(profFlush);
+  flushBucket();
+  PROF_STOP(profFlush);
+  return 0;
+}
+
+// Send the bucket being filled and start the one nextTime falls in,
+// one division per bucket, not per event; non zero means stop
+uint8_t nextBucket(void)
+{
+  if (sendBucket()) return 1;
+  if (nextTime >= bucketEnd) bucketEnd = frameMS ? nextTime - nextTime % frameMS + frameMS : nextTime + 1;
+  millis = nextTime;
+  return stopKeys();
+}
+
+
+// Stopping and pausing are not on the hot path, bytes go out one by one
+void slowOut(uint8_t x)
+{
+  if (bucketBytes == bucketcap) flushBucket();
+  MidiOut(x);
+  bucketBytes++;
+  stopBytes++;
+}
+
+
+// Send "All Sound Off" message to every MIDI out
+// Channel Mode Messages All Sounds Off (0x78) and All Notes Off (0x7B) for every channel
+const uint8_t soundOff[1+96] = {
+  96,
+  0xB0,0x78,0x00, 0xB0,0x7B,0x00,  0xB1,0x78,0x00, 0xB1,0x7B,0x00,
+  0xB2,0x78,0x00, 0xB2,0x7B,0x00,  0xB3,0x78,0x00, 0xB3,0x7B,0x00,
+  0xB4,0x78,0x00, 0xB4,0x7B,0x00,  0xB5,0x78,0x00, 0xB5,0x7B,0x00,
+  0xB6,0x78,0x00, 0xB6,0x7B,0x00,  0xB7,0x78,0x00, 0xB7,0x7B,0x00,
+  0xB8,0x78,0x00, 0xB8,0x7B,0x00,  0xB9,0x78,0x00, 0xB9,0x7B,0x00,
+  0xBA,0x78,0x00, 0xBA,0x7B,0x00,  0xBB,0x78,0x00, 0xBB,0x7B,0x00,
+  0xBC,0x78,0x00, 0xBC,0x7B,0x00,  0xBD,0x78,0x00, 0xBD,0x7B,0x00,
+  0xBE,0x78,0x00, 0xBE,0x7B,0x00,  0xBF,0x78,0x00, 0xBF,0x7B,0x00
+};
+
+void allSoundOff(void)
+{
+  for (outPort=0; outPort<maxports; outPort++)
+  {
+    if (!portLive(outPort)) continue;
+    if (bucketBytes + 96 > bucketcap) flushBucket();
+    midiOutBlock((uint8_t*)soundOff);
+    bucketBytes += 96;
+    stopBytes += 96;
+  }
+  outPort = 0;
+  memset(activeNotes, 0, sizeof(activeNotes));
+}
+
+
+// Keep the active notes and the channel state up to date with the
+// channel message just sent
+void trackActive(void)
+{
+  uint8_t channel = midievent.event & 0x0F;
+  uint8_t key = midievent.data[0] & 0x7F;
+  uint8_t* notes = &activeNotes[outSlot][(channel << 4) | (key >> 3)];
+  uint8_t i;
+
+  switch (midievent.event & 0xF0)
+  {
+    case 0x90:
+      if (midievent.data[1])
+      {
+        *notes |= keyBit[key & 7];
+        break;
+      }
+      // fall through, velocity 0 is a note off
+    case 0x80:
+      *notes &= ~keyBit[key & 7];
+      break;
+    case 0xB0:
+      if (key == MF_Sustain)
+      {
+        if (midievent.data[1] >= 64) sustainHeld[outSlot] |= 1 << channel;
+        else sustainHeld[outSlot] &= ~(1 << channel);
+      }
+      else if (key == 0x78 || key == 0x7B)
+      {
+        // All Sounds Off, All Notes Off
+        memset(&activeNotes[outSlot][channel << 4], 0, 16);
+      }
+      for (i=0; i<nctrl; i++)
+      {
+        if (ctrlNumber[i] == key) chanState[outSlot].ctrl[channel][i] = midievent.data[1];
+      }
+      break;
+    case 0xC0:
+      chanState[outSlot].program[channel] = key;
+      break;
+    case 0xE0:
+      chanState[outSlot].bend[channel][0] = key;
+      chanState[outSlot].bend[channel][1] = midievent.data[1] & 0x7F;
+      break;
+  }
+}
+
+
+// Note off for every sounding note with running status within a channel,
+// then sustain off where it is held, on every output.  The bytes are
+// queued in the bucket, the caller sends them.
+void releaseNotes(void)
+{
+  uint8_t channel, i, bit, bits, statusSent;
+  uint8_t* notes;
+
+  stopBytes = 0;
+  for (outPort=0; outPort<maxports; outPort++)
+  {
+    if (!portLive(outPort)) continue;
+    notes = activeNotes[outSlot];
+
+    for (channel=0; channel<16; channel++)
+    {
+      statusSent = 0;
+      for (i=0; i<16; i++)
+      {
+        bits = notes[(channel << 4) | i];
+        if (!bits) continue;
+
+        for (bit=0; bit<8; bit++)
+        {
+          if (!(bits & keyBit[bit])) continue;
+          if (!statusSent) slowOut(0x80 | channel);
+          statusSent = 1;
+          slowOut((i << 3) | bit);
+          slowOut(0x00);
+        }
+        notes[(channel << 4) | i] = 0;
+      }
+
+      if (sustainHeld[outSlot] & (1 << channel))
+      {
+        slowOut(0xB0 | channel);
+        slowOut(MF_Sustain);
+        slowOut(0x00);
+      }
+    }
+    sustainHeld[outSlot] = 0;
+  }
+  outPort = 0;
+}
+
+
+// Release what is sounding, then the full panic if stopPanic is set;
+// stopBytes says what it cost
+void stopNotes(void)
+{
+  releaseNotes();
+  if (stopPanic) allSoundOff();
+}
+
+
+// Send the channel state from before a pause again
+void restoreControllers(void)
+{
+  uint8_t channel, i;
+  CHANSTATE* now;
+
+  for (outPort=0; outPort<maxports; outPort++)
+  {
+    if (!portLive(outPort)) continue;
+    now = &chanState[outSlot];
+
+    for (channel=0; channel<16; channel++)
+    {
+      for (i=0; i<nctrl; i++)
+      {
+        if (now->ctrl[channel][i] & 0x80) continue;
+        slowOut(0xB0 | channel);
+        slowOut(ctrlNumber[i]);
+        slowOut(now->ctrl[channel][i]);
+        if (ctrlNumber[i] == MF_Sustain && now->ctrl[channel][i] >= 64) sustainHeld[outSlot] |= 1 << channel;
+      }
+      if (!(now->program[channel] & 0x80))
+      {
+        slowOut(0xC0 | channel);
+        slowOut(now->program[channel]);
+      }
+      if (!(now->bend[channel][0] & 0x80))
+      {
+        slowOut(0xE0 | channel);
+        slowOut(now->bend[channel][0]);
+        slowOut(now->bend[channel][1]);
+      }
+    }
+  }
+  outPort = 0;
+}
+
+
+// Only the channel state that changed inside the loop is sent again
+void restoreLoopControllers(void)
+{
+  uint8_t channel, i;
+  CHANSTATE* now;
+  CHANSTATE* saved;
+
+  for (outPort=0; outPort<maxports; outPort++)
+  {
+    if (!portLive(outPort)) continue;
+    now = &chanState[outSlot];
+    saved = &loopState.chan[outSlot];
+
+    for (channel=0; channel<16; channel++)
+    {
+      for (i=0; i<nctrl; i++)
+      {
+        // releaseNotes() has just lifted a held sustain pedal
+        if (saved->ctrl[channel][i] & 0x80) continue;
+        if (now->ctrl[channel][i] == saved->ctrl[channel][i] && !(ctrlNumber[i] == MF_Sustain && now->ctrl[channel][i] >= 64)) continue;
+        slowOut(0xB0 | channel);
+        slowOut(ctrlNumber[i]);
+        slowOut(saved->ctrl[channel][i]);
+        if (ctrlNumber[i] == MF_Sustain && saved->ctrl[channel][i] >= 64) sustainHeld[outSlot] |= 1 << channel;
+      }
+      if (now->program[channel] != saved->program[channel] && !(saved->program[channel] & 0x80))
+      {
+        slowOut(0xC0 | channel);
+        slowOut(saved->program[channel]);
+      }
+      if ((now->bend[channel][0] != saved->bend[channel][0] || now->bend[channel][1] != saved->bend[channel][1]) && !(saved->bend[channel][0] & 0x80))
+      {
+        slowOut(0xE0 | channel);
+        slowOut(saved->bend[channel][0]);
+        slowOut(saved->bend[channel][1]);
+      }
+    }
+  }
+  outPort = 0;
+  memcpy(chanState, loopState.chan, sizeof(chanState));
+}
+
+
+// Right after the loopStart marker: the next byte SDgetc returns is the
+// first delta of the loop
+void saveLoop(void)
+{
+  loopState.track = curTrack;
+  loopState.tpos = trackPos();
+  loopState.runningEvent = runningEvent;
+  loopState.tempo = tempo;
+  memcpy(loopState.chan, chanState, sizeof(chanState));
+  markSource();
+  loopsLeft = loopPasses;
+  loopSet = 1;
+}
+
+// Back to the loop start at the loopEnd marker's time: the bucket so far
+// goes out at its own time, then the sounding notes are released and the
+// channel state of the loop start sent again.  Non zero means stop
+uint8_t jumpLoop(void)
+{
+  if (nextBucket()) return 1;
+  rewindSource();
+  releaseNotes();
+  restoreLoopControllers();
+
+  tpos = loopState.tpos;
+  tpos16 = loopState.tpos;
+  runningEvent = loopState.runningEvent;
+  setTempo(loopState.tempo);
+  return 0;
+}
+
+// Non zero for the loop markers, they aren't shown
+uint8_t isLoopMarker(void)
+{
+  return (midievent.nbdata == 9 && !memcmp(midievent.data, "loopStart", 9)) ||
+         (midievent.nbdata == 7 && !memcmp(midievent.data, "loopEnd", 7));
+}
+
+// loopStart saves, loopEnd goes back; non zero means stop
+uint8_t loopMarker(void)
+{
+  if (midievent.nbdata == 9)
+  {
+    if (!loopSet) saveLoop();
+    return 0;
+  }
+  if (!loopSet || loopState.track != curTrack) return 0;
+  if (!loopsLeft)
+  {
+    // done, play on past the loop
+    loopSet = 0;
+    dropSource();
+    return 0;
+  }
+  if (loopsLeft != 255) loopsLeft--;
+  return jumpLoop();
+}
+
+
+// Read MIDI file header Chunk
+uint8_t readHeaderChunk(void)
+{
+  midiheader.chk[0] = SDgetc();
+  midiheader.chk[1] = SDgetc();
+  midiheader.chk[2] = SDgetc();
+  midiheader.chk[3] = SDgetc();
+  midiheader.length   = read32();
+  midiheader.format   = read16();
+  midiheader.ntracks  = read16();
+  midiheader.division = read16();
+
+  if (midiheader.chk[0]!='M' || midiheader.chk[1]!='T' || midiheader.chk[2]!='h' || midiheader.chk[3]!='d' || midiheader.length != 6 || !midiheader.division) return badFileheader;
+
+  setTempo(500000); // Default tempo : 500000 microsec / beat
+  return NoError;
+}
+
+
+// Read MIDI file track Chunk
+// Where the backend knows the file size the chunk has to be in the file,
+// so no read of the track can go past its end and play what is left in
+// the buffer
+uint8_t readTrackChunk(void)
+{
+  if (SDleft() < 8) return endOfFile;
+  miditrack.chk[0] = SDgetc();
+  miditrack.chk[1] = SDgetc();
+  miditrack.chk[2] = SDgetc();
+  miditrack.chk[3] = SDgetc();
+  miditrack.length  = read32();
+  // the 16 bit count unless the track is near 64KB: the last event may
+  // run up to 10 bytes past the chunk before the loop sees it, and
+  // tpos16 mustn't wrap round to the start
+  tlen16 = miditrack.length;
+  longTrack = miditrack.length > 0xFFFF - 16;
+
+  if (miditrack.chk[0]!='M' || miditrack.chk[1]!='T' || miditrack.chk[2]!='r' || miditrack.chk[3]!='k') return badTrackheader;
+  return miditrack.length <= SDleft() ? NoError : endOfFile;
+}
+
+
+// Read MIDI file track event, and send it
+uint8_t readTrackEvent(void)
+{
+  uint8_t c, n;
+  uint32_t len;
+
+  PROF_START(profDecode);
+  evBytes = 0;
+  // Read time
+  midievent.wait = readVariableLength();
+  // Read track event
+  midievent.event = SDgetc(); ++evBytes;
+
+  if (midievent.event == 0xFF)
+  {
+    // Meta event
+    // read Meta event type
+    midievent.mtype = SDgetc(); ++evBytes;
+    // read data length, not past the end of the track
+    len = readVariableLength();
+    if (len > trackLeft()) return endOfFile;
+    // read data
+    readMeta(len);
+    if (midievent.mtype == MF_Meta_Tempo) // tempo
+    {
+      setTempo(midievent.data[0] * 65536 + midievent.data[1] * 256 + midievent.data[2]);
+    }
+    else if (midievent.mtype == MF_Meta_MIDI_Port || midievent.mtype == MF_Meta_MIDI_channel) portMeta();
+  }
+  else if (midievent.event == 0XF0 || midievent.event == 0xF7)
+  {
+    // SysEx event
+    midievent.nbdata = 0;
+    // up to F7 or the end of the track
+    len = trackLeft();
+    while (len)
+    {
+      // read one byte
+      c = SDgetc(); --len;
+      if (midievent.nbdata < maxdata) midievent.data[midievent.nbdata++] = c;
+      if (c == 0xF7) break;
+    }
+    trackSkip(trackLeft() - len);
+  }
+  else if (midievent.event & 0x80)
+  {
+    // Midi event
+    runningEvent = midievent.event;
+    // calculate the number of data bytes
+    midievent.nbdata = ((midievent.event & 0xE0) == 0xC0 ? 1 : 2);
+    // Read data bytes
+    readNdata(0);
+  }
+  else
+  {
+    // Running event
+    if (!runningEvent) return badEvent;
+    statRunning();
+    // transfer first byte from event to data
+    midievent.data[0] = midievent.event;
+    // recall last event value
+    midievent.event = runningEvent;
+    // calculate the number of data bytes
+    midievent.nbdata = ((runningEvent & 0xE0) == 0xC0 ? 1 : 2);
+    // Read data bytes (starting from the second one since the first byte is alread in data)
+    readNdata(1);
+  }
+  // the event's bytes go on the position at once, 16 bits for a short
+  // track; a channel event can't end past the end of its track
+  if (longTrack)
+  {
+    tpos += evBytes;
+    if (tpos > miditrack.length) return endOfFile;
+  }
+  else
+  {
+    tpos16 += evBytes;
+    if (tpos16 > tlen16) return endOfFile;
+  }
+  PROF_STOP(profDecode);
+  statEvent(midievent.event, midievent.mtype, midievent.nbdata);
+
+  // Calculate next time on which data shall be played
+  PROF_START(profTempo);
+  nextTime += waitMS(midievent.wait);
+  PROF_STOP(profTempo);
+  if (timeUp()) return userStop;
+
+  if (midievent.event == 0xFF)
+  {
+    if (midievent.mtype == MF_Meta_Marker && isLoopMarker()) return loopMarker() ? userStop : NoError;
+    if (midievent.mtype == MF_Meta_Lyric || midievent.mtype == MF_Meta_Marker) textEvent();
+    return NoError;
+  }
+
+  // Output to MIDI device
+  c = eventPort();
+  if (playPort != 255 && c != playPort) return NoError;
+  outPort = portSlot(c);
+
+  n = midievent.nbdata < maxdata ? midievent.nbdata + 1 : maxdata + 1;
+  if (transforms && midievent.event < 0xF0) applyTransforms();
+  if (nextTime >= bucketEnd || bucketBytes + n > bucketcap)
+  {
+    // the queued bucket goes out at its time
+    if (nextBucket()) return userStop;
+  }
+  bucketBytes += n;
+  midievent.len = n;
+  midiOutBlock(&midievent.len);
+
+  if (midievent.event < 0xF0) trackActive();
+  return NoError;
+}
+
+
+// Ready for a song from its first byte: the settings stay
+void resetSong(void)
+{
+  nextTime = 0;
+  millis = 0;
+  runningEvent = 0;
+  bucketEnd = frameMS ? frameMS : 1;
+  bucketBytes = 0;
+  loopSet = 0;
+  memset(chanState, 0xFF, sizeof(chanState));
+}
+
+
+// The events of the track whose header was just read
+uint8_t playTrack(void)
+{
+  uint8_t err = NoError;
+
+  resetPorts();
+  tpos = 0;
+  tpos16 = 0;
+  while (!err && (longTrack ? tpos < miditrack.length : tpos16 < tlen16))
+  {
+    err = readTrackEvent();
+  }
+  return err;
+}
+
+
+// Every track in turn, the first one's header already read
+uint8_t playTracks(void)
+{
+  uint8_t err = NoError;
+
+  for (curTrack=1; curTrack <= midiheader.ntracks && !err; curTrack++)
+  {
+    if (curTrack > 1) err = readTrackChunk();
+    if (!err) err = playTrack();
+  }
+  return err;
+}
+
+#endif
@@ -0,0 +1,745 @@
+// based on https://community.atmel.com/projects/sd-card-midi-player
+//
+// midimin: rewrite a MIDI file as the smallest equivalent SMF for the SD card
+//   gcc -O2 -o midimin midimin.c
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+extern char** environ;
+// Controller
+#define MF_Bank_Select_MSB    0x00	// 0x00 .Bank Select MSB (value 0x50 : Preset A Patch 1..128, 0x51 Preset B Patch 129..255)
+#define MF_Bank_Select_LSB    0x20	// 0x20 .Bank Select LSB (value 0x00)
+#define MF_Modulation         0x01	// 0x01 .Modulation
+#define MF_Breath             0x02	// 0x02  Breath Controller
+#define MF_Foot               0x04	// 0x04  Foot Controller
+#define MF_Portamento_Time    0x05	// 0x05 .Portamento Time
+#define MF_Main_Volume        0x07	// 0x07 .Main Volume
+#define MF_Balance            0x08	// 0x08  Balance
+#define MF_Pan                0x0A	// 0x0A .Pan
+#define MF_Expression         0x0B	// 0x0B .Expression Controller
+#define MF_Effect_1           0x0C	// 0x0C  Effect Control 1
+#define MF_Effect_2           0x0D	// 0x0D  Effect Control 2
+#define MF_General_1to4       0x13	// 0x13  General-Purpose Controllers 1-4
+#define MF_Controller_LSB     0x3F	// 0x3F  LSB for controllers 0-31
+#define MF_Sustain            0x40	// 0x40 .Sustain(Damper pedal / Hold 1)
+#define MF_Portamento         0x41	// 0x41 .Portamento
+#define MF_Sostenuto          0x42	// 0x42 .Sostenuto
+#define MF_Soft               0x43	// 0x43 .Soft Pedal
+#define MF_Legato             0x44	// 0x44  Legato Footswitch
+#define MF_Hold               0x45	// 0x45  Hold 2
+#define MF_Control_1          0x46	// 0x46  Sound Controller 1 (default: Timber Variation)
+#define MF_Control_2          0x47	// 0x47  Sound Controller 2 (default: Timber/Harmonic Content)
+#define MF_Control_3          0x48	// 0x48  Sound Controller 3 (default: Release Time)
+#define MF_Control_4          0x49	// 0x49  Sound Controller 4 (default: Attack Time)
+#define MF_Portamento_Ctrl    0x54	// 0x54  Portamento Control
+#define MF_Reverb             0x5B	// 0x5B .Effects 1 Depth (M-GS64 : Reverb send level)
+#define MF_Effects_2          0x5C	// 0x5C  Effects 2 Depth (formerly Tremolo Depth)
+#define MF_Chorus             0x5D	// 0x5D .Effects 3 Depth (M-GS64 : Chorus send level)
+#define MF_Effects_4          0x5E	// 0x5E  Effects 4 Depth (formerly Celeste Detune)
+#define MF_Effects_5          0x5F	// 0x5F  Effects 5 Depth (formerly Phaser Depth)
+#define MF_Data_Increment     0x60	// 0x60  Data Increment
+#define MF_Data_Decrement     0x61	// 0x61  Data Decrement
+#define MF_NRPN_LSB           0x62	// 0x62 .Non-Registered Parameter Number (LSB)
+#define MF_NRPN_MSB           0x63	// 0x63 .Non-Registered Parameter Number (MSB)
+#define MF_RPN_LSB            0x64	// 0x64 .Registered Parameter Number (LSB)
+#define MF_RPN_MSB            0x65	// 0x65 .Registered Parameter Number (MSB)
+#define MF_Mode_Message       0x7F	// 0x7F  Mode Messages
+#define MF_Data_Entry_MSB     0x06	// 0x06  Data Entry (MSB)
+#define MF_Data_Entry_LSB     0x26	// 0x26  Data Entry (LSB)
+
+// MIDI File Formats
+#define MF_Single_track       0x00
+#define MF_Parallel_tracks    0x01
+#define MF_Sequential_tracks  0x02
+
+// Meta Events Type
+#define MF_Meta_Sequence         0x00  // Sequence number
+#define MF_Meta_Text             0x01  // Text event
+#define MF_Meta_Copyright        0x02  // Copyright
+#define MF_Meta_Track_name       0x03  // track name
+#define MF_Meta_Instrument_name  0x04  // Instrument name
+#define MF_Meta_Lyric            0x05  // Lyric text
+#define MF_Meta_Marker           0x06  // Marker text
+#define MF_Meta_Cue_point        0x07  // Cue point
+#define MF_Meta_MIDI_channel     0x20  // MIDI channel
+#define MF_Meta_MIDI_Port        0x21  // MIDI Port
+#define MF_Meta_Track_End        0x2F  // End of track
+#define MF_Meta_Tempo            0x51  // tempo setting
+#define MF_Meta_SMPTE_offset     0x54  // SMPTE offset
+#define MF_Meta_Time_signature   0x58  // Time signature
+#define MF_Meta_Key_signature    0x59  // Key signature
+#define MF_Meta_Special          0x7F  // Seq. special
+
+FILE* midiFile;
+
+// FILE header INFORMATION
+typedef struct
+{
+  uint8_t  chk[5];
+  uint32_t length;
+  uint16_t format;
+  uint16_t ntracks;
+  uint16_t division;
+} MTHD;
+
+// TRACK INFORMATION
+typedef struct
+{
+  uint8_t  chk[5];
+  uint32_t length;
+} MTRK;
+
+// EVENT INFORMATION
+// data is not capped here, every byte has to make it to the output
+typedef struct
+{
+  uint32_t wait;
+  uint8_t  event;
+  uint8_t  mtype; // only for Meta Events
+  uint32_t nbdata;
+} MTEV;
+
+// RETURN CODES
+enum MIDIerrors
+{
+  NoError        = 0,
+  badFileheader  = 1,
+  badTrackheader = 2,
+  badEvent       = 3,
+  endOfFile      = 4,
+  userStop       = 5
+};
+
+// A file that doesn't parse exits with parseExit + its code, clear of the
+// 1 for usage and I/O errors, so a batch run can tell which it was
+#define parseExit 10
+
+// One event of the whole song, tick is absolute within its track
+typedef struct
+{
+  uint32_t tick;
+  uint16_t track;
+  uint8_t  status;
+  uint8_t  mtype;
+  uint32_t nbdata;
+  uint32_t offset;  // of the data in SONG.pool
+} EVENT;
+
+typedef struct
+{
+  MTHD      header;
+  EVENT*    events;
+  uint32_t  nevents;
+  uint32_t  maxevents;
+  uint8_t*  pool;
+  uint32_t  npool;
+  uint32_t  maxpool;
+  uint32_t* trackEnd;   // tick of each track's End of Track
+  uint32_t  size;       // file size in bytes
+  uint32_t  statusBytes;
+  uint32_t  deltaBytes;
+} SONG;
+
+// Position in track
+uint32_t tpos     = 0;
+
+// LAST EVENT READ
+uint8_t runningEvent = 0;
+
+// Shared variables
+MTRK miditrack;
+MTEV midievent;
+SONG* song;
+
+int sdDatIdx = 255;
+uint8_t sdData[256];
+
+// Options
+uint8_t mergeTracks = 0;
+uint8_t keepMetas = 0;
+
+// Counters for the report
+uint32_t strippedMetas = 0;
+uint32_t strippedBytes = 0;
+
+
+// Make room for "extra" more elements in a growable array
+void* growArray(void* array, uint32_t used, uint32_t extra, uint32_t* max, size_t size)
+{
+  if (used + extra <= *max) return array;
+
+  while (used + extra > *max) *max = *max ? *max * 2 : 4096;
+  array = realloc(array, *max * size);
+  if (!array) {
+    puts("out of memory.");
+    exit(1);
+  }
+  return array;
+}
+
+
+// length is tracked by midi reader so we don't need to do it here
+//
+uint8_t SDgetc(void)
+{
+  ++sdDatIdx;
+  sdDatIdx &= 255;
+  if (sdDatIdx == 0) {
+    fread(sdData, 1, 256, midiFile);
+  }
+
+  return sdData[sdDatIdx];
+}
+
+
+// Read a 16 bits integer
+uint16_t read16(void)
+{
+  uint16_t v = SDgetc();
+  v = v * 256;
+  v += SDgetc();
+  return v;
+}
+
+
+// Read a 32 bits integer
+uint32_t read32(void)
+{
+  uint32_t v = SDgetc();
+  v *= 256;
+  v += SDgetc();
+  v *= 256;
+  v += SDgetc();
+  v *= 256;
+  v += SDgetc();
+  return v;
+}
+
+
+// Read a byte but stops if size of the track is excessed
+uint8_t readTrackByte(void)
+{
+  uint8_t c = 0;
+  if (tpos < miditrack.length)
+  {
+    c = SDgetc();
+    tpos++;
+  }
+  return c;
+}
+
+
+// Read a MIDI "variable length" integer
+uint32_t readVariableLength()
+{
+  uint32_t v = 0;
+  uint8_t c;
+  c = readTrackByte();
+  v = c & 0x7F;
+  while (c & 0x80)
+  {
+    c = readTrackByte();
+    v = (v << 7) | (c & 0x7F);
+  }
+  return v;
+}
+
+
+// Read "midievent.nbdata" bytes into the data pool starting at "start"
+uint8_t readNdata(uint32_t start)
+{
+  song->pool = growArray(song->pool, song->npool, midievent.nbdata, &song->maxpool, 1);
+  for (uint32_t i=start; i<midievent.nbdata; i++)
+  {
+    song->pool[song->npool + i] = readTrackByte();
+  }
+  return 0;
+}
+
+
+// Read MIDI file header Chunk
+uint8_t readHeaderChunk(void)
+{
+  MTHD* midiheader = &song->header;
+
+  for (int i=0; i<4; i++) midiheader->chk[i] = SDgetc();
+  midiheader->length = read32();
+
+  midiheader->format   = read16();
+  midiheader->ntracks  = read16();
+  midiheader->division = read16();
+
+  // skip any extra header bytes
+  for (uint32_t i=6; i<midiheader->length && i<256; i++) SDgetc();
+
+  return midiheader->chk[0]=='M' && midiheader->chk[1]=='T' && midiheader->chk[2]=='h' && midiheader->chk[3]=='d' && midiheader->length >= 6 ? NoError : badFileheader;
+}
+
+
+// Read MIDI file track Chunk
+uint8_t readTrackChunk(void)
+{
+  for (int i=0; i<4; i++) miditrack.chk[i] = SDgetc();
+  miditrack.length  = read32();
+  return miditrack.chk[0]=='M' && miditrack.chk[1]=='T' && miditrack.chk[2]=='r' && miditrack.chk[3]=='k' ? NoError : badTrackheader;
+}
+
+
+// Read MIDI file track event and append it to the song
+uint8_t readTrackEvent(uint16_t track, uint32_t* tick)
+{
+  uint32_t start = tpos;
+  EVENT* ev;
+
+  // Read time
+  midievent.wait = readVariableLength();
+  song->deltaBytes += tpos - start;
+  *tick += midievent.wait;
+
+  // Read track event
+  midievent.event = readTrackByte();
+  midievent.mtype = 0;
+
+  if (midievent.event == 0xFF)
+  {
+    // Meta event
+    midievent.mtype = readTrackByte();
+    midievent.nbdata = readVariableLength();
+    readNdata(0);
+  }
+  else if (midievent.event == 0XF0 || midievent.event == 0xF7)
+  {
+    // SysEx event, length prefixed
+    midievent.nbdata = readVariableLength();
+    readNdata(0);
+  }
+  else if (midievent.event & 0x80)
+  {
+    // Midi event
+    runningEvent = midievent.event;
+    song->statusBytes++;
+    midievent.nbdata = ((midievent.event & 0xE0) == 0xC0 ? 1 : 2);
+    readNdata(0);
+  }
+  else
+  {
+    // Running event
+    if (!runningEvent) return badEvent;
+    song->pool = growArray(song->pool, song->npool, 2, &song->maxpool, 1);
+    song->pool[song->npool] = midievent.event;
+    midievent.event = runningEvent;
+    midievent.nbdata = ((runningEvent & 0xE0) == 0xC0 ? 1 : 2);
+    readNdata(1);
+  }
+
+  song->events = growArray(song->events, song->nevents, 1, &song->maxevents, sizeof(EVENT));
+  ev = &song->events[song->nevents++];
+  ev->tick = *tick;
+  ev->track = track;
+  ev->status = midievent.event;
+  ev->mtype = midievent.mtype;
+  ev->nbdata = midievent.nbdata;
+  ev->offset = song->npool;
+  song->npool += midievent.nbdata;
+
+  return NoError;
+}
+
+
+// Read a whole MIDI file into memory
+uint8_t loadMidi(const char* name, SONG* into)
+{
+  uint8_t err;
+
+  memset(into, 0, sizeof(SONG));
+  song = into;
+
+  midiFile = fopen(name, "rb");
+  if (!midiFile) return endOfFile;
+  // the whole file, chunks the parser never reads included
+  fseek(midiFile, 0, SEEK_END);
+  song->size = ftell(midiFile);
+  fseek(midiFile, 0, SEEK_SET);
+  sdDatIdx = 255;
+
+  err = readHeaderChunk();
+  if (!err) song->trackEnd = calloc(song->header.ntracks + 1, sizeof(uint32_t));
+
+  for (uint16_t i=1; i<=song->header.ntracks && !err; i++)
+  {
+    uint32_t tick = 0;
+
+    err = readTrackChunk();
+    runningEvent = 0;
+
+    for (tpos=0; tpos < miditrack.length && !err;)
+    {
+      err = readTrackEvent(i, &tick);
+    }
+    song->trackEnd[i] = tick;
+  }
+
+  fclose(midiFile);
+  return err;
+}
+
+
+// PLAYBACK ORDER
+// Events of all tracks by tick, ties in track then file order.  Both the
+// original and the rewritten file must produce the same sequence.
+SONG* sortSong;
+
+int compareEvents(const void* a, const void* b)
+{
+  const EVENT* ea = &sortSong->events[*(const uint32_t*)a];
+  const EVENT* eb = &sortSong->events[*(const uint32_t*)b];
+  if (ea->tick != eb->tick) return ea->tick < eb->tick ? -1 : 1;
+  if (ea->track != eb->track) return ea->track < eb->track ? -1 : 1;
+  return *(const uint32_t*)a < *(const uint32_t*)b ? -1 : 1;
+}
+
+uint32_t* playbackOrder(SONG* s)
+{
+  uint32_t* order = malloc((s->nevents + 1) * sizeof(uint32_t));
+  if (!order) {
+    puts("out of memory.");
+    exit(1);
+  }
+  for (uint32_t i=0; i<s->nevents; i++) order[i] = i;
+  sortSong = s;
+  qsort(order, s->nevents, sizeof(uint32_t), compareEvents);
+  return order;
+}
+
+
+// WRITER
+uint8_t* out = NULL;
+uint32_t nout = 0;
+uint32_t maxout = 0;
+uint32_t statusBytesOut = 0;
+uint32_t deltaBytesOut = 0;
+
+void putByte(uint8_t c)
+{
+  out = growArray(out, nout, 1, &maxout, 1);
+  out[nout++] = c;
+}
+
+void put32(uint32_t v)
+{
+  putByte(v >> 24);
+  putByte(v >> 16);
+  putByte(v >> 8);
+  putByte(v);
+}
+
+// Shortest encoding of a variable length integer
+uint32_t putVariableLength(uint32_t v)
+{
+  uint8_t bytes[5];
+  uint32_t n = 0;
+
+  do
+  {
+    bytes[n++] = v & 0x7F;
+    v >>= 7;
+  } while (v);
+
+  for (uint32_t i=n; i>0; i--) putByte(bytes[i-1] | (i > 1 ? 0x80 : 0));
+  return n;
+}
+
+// Meta events the players never need: text, copyright, track and
+// instrument names and sequencer specific data.  Lyrics and markers stay,
+// tinymidiplay shows them and the loop points are markers.
+uint8_t strippable(EVENT* ev)
+{
+  if (keepMetas || ev->status != 0xFF) return 0;
+  return (ev->mtype >= MF_Meta_Text && ev->mtype <= MF_Meta_Instrument_name) || ev->mtype == MF_Meta_Special;
+}
+
+// Write one MTrk from a list of event indexes already in playback order
+void writeTrack(SONG* s, uint32_t* list, uint32_t n, uint32_t endTick)
+{
+  uint32_t lengthAt, lastTick = 0;
+  uint8_t running = 0;
+
+  putByte('M');
+  putByte('T');
+  putByte('r');
+  putByte('k');
+  lengthAt = nout;
+  put32(0);
+
+  for (uint32_t i=0; i<n; i++)
+  {
+    EVENT* ev = &s->events[list[i]];
+    uint8_t* data = &s->pool[ev->offset];
+
+    if (ev->status == 0xFF && ev->mtype == MF_Meta_Track_End) continue;
+    if (strippable(ev))
+    {
+      // its delta time carries over to the next event written
+      strippedMetas++;
+      strippedBytes += ev->nbdata;
+      continue;
+    }
+
+    deltaBytesOut += putVariableLength(ev->tick - lastTick);
+    lastTick = ev->tick;
+
+    if (ev->status == 0xFF)
+    {
+      putByte(0xFF);
+      putByte(ev->mtype);
+      putVariableLength(ev->nbdata);
+      running = 0;
+    }
+    else if (ev->status == 0xF0 || ev->status == 0xF7)
+    {
+      putByte(ev->status);
+      putVariableLength(ev->nbdata);
+      running = 0;
+    }
+    else if (ev->status != running)
+    {
+      putByte(ev->status);
+      running = ev->status;
+      statusBytesOut++;
+    }
+
+    for (uint32_t j=0; j<ev->nbdata; j++) putByte(data[j]);
+  }
+
+  deltaBytesOut += putVariableLength(endTick > lastTick ? endTick - lastTick : 0);
+  putByte(0xFF);
+  putByte(MF_Meta_Track_End);
+  putByte(0);
+
+  uint32_t length = nout - lengthAt - 4;
+  out[lengthAt]   = length >> 24;
+  out[lengthAt+1] = length >> 16;
+  out[lengthAt+2] = length >> 8;
+  out[lengthAt+3] = length;
+}
+
+void writeMidi(SONG* s)
+{
+  uint32_t* order = playbackOrder(s);
+  uint16_t ntracks = mergeTracks ? 1 : s->header.ntracks;
+  uint16_t format = mergeTracks ? MF_Single_track : s->header.format;
+
+  putByte('M');
+  putByte('T');
+  putByte('h');
+  putByte('d');
+  put32(6);
+  putByte(format >> 8);
+  putByte(format);
+  putByte(ntracks >> 8);
+  putByte(ntracks);
+  putByte(s->header.division >> 8);
+  putByte(s->header.division);
+
+  if (mergeTracks)
+  {
+    uint32_t endTick = 0;
+    for (uint16_t t=1; t<=s->header.ntracks; t++) if (s->trackEnd[t] > endTick) endTick = s->trackEnd[t];
+    writeTrack(s, order, s->nevents, endTick);
+  }
+  else
+  {
+    // the events of each track are contiguous and in order already
+    uint32_t first = 0;
+    for (uint16_t t=1; t<=s->header.ntracks; t++)
+    {
+      uint32_t last = first;
+      while (last < s->nevents && s->events[last].track == t) last++;
+      for (uint32_t i=first; i<last; i++) order[i] = i;
+      writeTrack(s, order + first, last - first, s->trackEnd[t]);
+      first = last;
+    }
+  }
+
+  free(order);
+}
+
+
+// VERIFICATION
+// The rewritten file is played by pcplay -t, next to midimin, and its
+// timestamped stream must be byte for byte the one of the original: that
+// is what the players send, with their own SysEx framing.  The players
+// play the tracks of a file one after the other, so -0 on more than one
+// track changes the stream on purpose; then the events are compared in
+// time order with their tick instead.
+char pcplay[1024] = "pcplay";
+
+// pcplay -t of file into a temporary file, read back; NULL if it failed
+uint8_t* playStream(const char* file, uint32_t* len)
+{
+  char tmp[] = "/tmp/midiminXXXXXX";
+  char* argv[] = { pcplay, "-t", "-o", tmp, (char*)file, NULL };
+  int fd = mkstemp(tmp), status;
+  uint8_t* data = NULL;
+  pid_t pid;
+  FILE* f;
+  long n;
+
+  if (fd < 0) return NULL;
+  close(fd);
+  if (!posix_spawnp(&pid, pcplay, NULL, NULL, argv, environ) &&
+      waitpid(pid, &status, 0) == pid && WIFEXITED(status) && !WEXITSTATUS(status) &&
+      (f = fopen(tmp, "rb")))
+  {
+    fseek(f, 0, SEEK_END);
+    n = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = malloc(n + 1);
+    if (data && fread(data, 1, n, f) != (size_t)n) {
+      free(data);
+      data = NULL;
+    }
+    *len = n;
+    fclose(f);
+  }
+  unlink(tmp);
+  return data;
+}
+
+uint8_t samePlayback(const char* a, const char* b)
+{
+  uint32_t na, nb, i;
+  uint8_t* sa = playStream(a, &na);
+  uint8_t* sb = playStream(b, &nb);
+  uint8_t same = sa && sb && na == nb && !memcmp(sa, sb, na);
+
+  if (!sa || !sb) printf("verify: can't play %s with %s\n", sa ? b : a, pcplay);
+  else if (!same)
+  {
+    for (i=0; i<na && i<nb && sa[i] == sb[i]; i++);
+    printf("verify: pcplay streams differ at byte %d\n", i);
+  }
+  free(sa);
+  free(sb);
+  return same;
+}
+
+uint8_t sameEvents(SONG* a, SONG* b)
+{
+  uint32_t* oa = playbackOrder(a);
+  uint32_t* ob = playbackOrder(b);
+  uint32_t ia = 0, ib = 0;
+  uint8_t same = 1;
+
+  while (same)
+  {
+    while (ia < a->nevents && a->events[oa[ia]].status == 0xFF && a->events[oa[ia]].mtype != MF_Meta_Tempo) ia++;
+    while (ib < b->nevents && b->events[ob[ib]].status == 0xFF && b->events[ob[ib]].mtype != MF_Meta_Tempo) ib++;
+    if (ia == a->nevents || ib == b->nevents)
+    {
+      same = ia == a->nevents && ib == b->nevents;
+      if (!same) printf("verify: event count differs\n");
+      break;
+    }
+
+    EVENT* ea = &a->events[oa[ia]];
+    EVENT* eb = &b->events[ob[ib]];
+    if (ea->tick != eb->tick || ea->status != eb->status || ea->mtype != eb->mtype || ea->nbdata != eb->nbdata ||
+        memcmp(&a->pool[ea->offset], &b->pool[eb->offset], ea->nbdata))
+    {
+      printf("verify: event %d differs at tick %d\n", ia, ea->tick);
+      same = 0;
+    }
+    ia++;
+    ib++;
+  }
+
+  free(oa);
+  free(ob);
+  return same;
+}
+
+
+int usage(void)
+{
+  puts("usage: midimin [-0] [-a] input.mid output.mid");
+  puts("  -0  merge all tracks into a format 0 file");
+  puts("  -a  keep all meta events, not only lyrics, markers and the ones that play");
+  return 1;
+}
+
+int main(int argc, char** argv)
+{
+  SONG input;
+  FILE* f;
+  int opt;
+  uint8_t err;
+
+  while ((opt = getopt(argc, argv, "0a")) != -1)
+  {
+    switch (opt)
+    {
+      case '0': mergeTracks = 1; break;
+      case 'a': keepMetas = 1; break;
+      default: return usage();
+    }
+  }
+  if (optind + 2 != argc) return usage();
+
+  err = loadMidi(argv[optind], &input);
+  if (err == endOfFile) {
+    puts("can't open input file.");
+    return 1;
+  }
+  if (err) {
+    printf("error %d reading input file.\n", err);
+    return parseExit + err;
+  }
+  if (input.header.format == MF_Sequential_tracks && mergeTracks) {
+    puts("format 2 tracks are independent patterns and can't be merged.");
+    return 1;
+  }
+
+  writeMidi(&input);
+
+  f = fopen(argv[optind+1], "wb");
+  if (!f || fwrite(out, 1, nout, f) != nout || fclose(f)) {
+    puts("can't write output file.");
+    return 1;
+  }
+
+  printf("Input:  %d bytes, %d tracks, format %d\n", input.size, input.header.ntracks, input.header.format);
+  printf("Output: %d bytes, %d tracks, format %d\n", nout, mergeTracks ? 1 : input.header.ntracks, mergeTracks ? 0 : input.header.format);
+  printf("Saved:  %d bytes (%.1f%%)\n", input.size - nout, input.size ? 100.0 * ((double)input.size - nout) / input.size : 0.0);
+  printf("  status bytes  %d -> %d\n", input.statusBytes, statusBytesOut);
+  printf("  delta bytes   %d -> %d\n", input.deltaBytes, deltaBytesOut);
+  printf("  metas removed %d (%d data bytes)\n", strippedMetas, strippedBytes);
+
+  // pcplay is next to midimin, or on the PATH
+  if (strrchr(argv[0], '/')) {
+    snprintf(pcplay, sizeof(pcplay), "%.*s/pcplay", (int)(strrchr(argv[0], '/') - argv[0]), argv[0]);
+  }
+  if (mergeTracks && input.header.ntracks > 1) {
+    SONG output;
+    err = loadMidi(argv[optind+1], &output);
+    if (err || !sameEvents(&input, &output)) {
+      puts("verify: FAILED, output does not have the same events");
+      return 2;
+    }
+    puts("verify: same events (-0, the players' stream changes)");
+    return 0;
+  }
+  if (!samePlayback(argv[optind], argv[optind+1])) {
+    puts("verify: FAILED, output does not play back the same");
+    return 2;
+  }
+  puts("verify: same playback");
+
+  return 0;
+}
@@ -3,7 +3,11 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdint.h>
-#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include "midistats.h"
 
 // Controller
 #define MF_Bank_Select_MSB    0x00	// 0x00 .Bank Select MSB (value 0x50 : Preset A Patch 1..128, 0x51 Preset B Patch 129..255)
@@ -89,7 +93,7 @@ typedef struct
 } MTRK;
 
 // EVENT INFORMATION
-#define maxdata 127
+#define maxdata 128
 typedef struct
 {
   uint32_t wait;
@@ -110,6 +114,10 @@ enum MIDIerrors
 	userStop       = 5
 };
 
+// A file that doesn't parse exits with parseExit + its code, clear of the
+// 1 for usage and I/O errors, so a batch run can tell which it was
+#define parseExit 10
+
 // FUNCTIONS
 void     clearBuffer(void);
 uint8_t  readByte(void);
@@ -122,6 +130,7 @@ uint32_t readVariableLength(void);
 uint8_t  readNdata(uint8_t start);
 uint8_t  readTrackEvent(void);
 void     allSoundOff(void);
+void     emitEvent(uint16_t track);
 
 // Position in track
 uint32_t tpos     = 0;
@@ -138,13 +147,458 @@ MTHD midiheader;
 MTRK miditrack;
 MTEV midievent;
 
-uint32_t nextTimeMS = 0;
-uint32_t nextTimeUS = 0;
+// Absolute time of the current event in ticks, microseconds and milliseconds
+uint32_t trackTick = 0;
+uint32_t endTick = 0;
+uint64_t nowUS = 0;
+uint32_t nowMS = 0;
+uint64_t endUS = 0;
+
+// Pass 1 only collects the tempo map, pass 2 reports
+uint8_t reporting = 0;
+uint8_t printing = 0;
+
+// OUTPUT MODES
+enum OUTPUTmodes
+{
+  textOutput   = 0,
+  jsonOutput   = 1,
+  binaryOutput = 2
+};
+
+uint8_t  outputMode = textOutput;
+uint8_t  listEvents = 0;
+uint16_t classFilter = 0xFFFF;    // bit (status >> 4), bit 0 for meta events
+uint16_t channelFilter = 0xFFFF;  // bit per channel, excludes meta and SysEx when set
+
+// Per track and whole file counts
+uint16_t trackIndex = 0;
+uint32_t trackEvents = 0;
+uint32_t totalEvents = 0;
+uint8_t  trackName[maxdata];
+uint32_t trackNameLength = 0;
 
 int32_t dpos = -1;
 int sdDatIdx = 255;
 uint8_t sdData[256];
 
+// NOTE PAIRING
+// every (channel, key) has its own stack of note-on times so overlapping
+// notes on the same key pair up last-on / first-off, in O(1) per event
+#define maxstack 32
+typedef struct
+{
+  uint32_t start[maxstack];
+  uint8_t  depth;
+} NOTESTACK;
+
+// per channel results
+typedef struct
+{
+  uint32_t notes;
+  uint32_t stuck;
+  uint32_t orphans;     // note-off without a sounding note
+  uint32_t overflows;   // note-on dropped because the key stack was full
+  uint32_t minDuration;
+  uint32_t maxDuration;
+  uint64_t sumDuration; // also the area under the polyphony curve
+  uint16_t sounding;
+  uint16_t peak;
+} CHANSTAT;
+
+// start (+1) and end (-1) of every paired note, for the polyphony sweep
+typedef struct
+{
+  uint32_t time;
+  int8_t   delta;
+  uint8_t  channel;
+  uint8_t  rank;        // order at the same time, see compareEdges
+} NOTEEDGE;
+
+NOTESTACK notestack[16][128];
+CHANSTAT  chanstat[16];
+NOTEEDGE* noteedges = NULL;
+uint32_t  nedges = 0;
+uint32_t  maxedges = 0;
+uint16_t  peakAll = 0;
+
+// Make room for one more element in a growable array
+void* growArray(void* array, uint32_t used, uint32_t* max, size_t size)
+{
+  if (used < *max) return array;
+
+  *max = *max ? *max * 2 : 256;
+  array = realloc(array, *max * size);
+  if (!array) {
+    puts("out of memory.");
+    exit(1);
+  }
+  return array;
+}
+
+void addEdge(uint32_t time, int8_t delta, uint8_t channel, uint8_t rank)
+{
+  noteedges = growArray(noteedges, nedges, &maxedges, sizeof(NOTEEDGE));
+  noteedges[nedges].time = time;
+  noteedges[nedges].delta = delta;
+  noteedges[nedges].channel = channel;
+  noteedges[nedges].rank = rank;
+  nedges++;
+}
+
+void noteOn(uint8_t channel, uint8_t key, uint32_t now)
+{
+  NOTESTACK* ns = &notestack[channel][key];
+  if (ns->depth == maxstack)
+  {
+    chanstat[channel].overflows++;
+    return;
+  }
+  ns->start[ns->depth++] = now;
+  addEdge(now, 1, channel, 1);
+}
+
+void noteOff(uint8_t channel, uint8_t key, uint32_t now)
+{
+  NOTESTACK* ns = &notestack[channel][key];
+  CHANSTAT* cs = &chanstat[channel];
+  uint32_t duration;
+
+  if (ns->depth == 0)
+  {
+    cs->orphans++;
+    return;
+  }
+
+  duration = now - ns->start[--ns->depth];
+  if (cs->notes == 0 || duration < cs->minDuration) cs->minDuration = duration;
+  if (duration > cs->maxDuration) cs->maxDuration = duration;
+  cs->sumDuration += duration;
+  cs->notes++;
+  addEdge(now, -1, channel, duration ? 0 : 2);
+}
+
+// Close notes still sounding when the track ends
+void closeHangingNotes(uint32_t now)
+{
+  for (uint8_t channel=0; channel<16; channel++)
+  {
+    for (uint8_t key=0; key<128; key++)
+    {
+      NOTESTACK* ns = &notestack[channel][key];
+      while (ns->depth)
+      {
+        if (printing) printf("Stuck note: channel %d key %d @ %d\n", channel+1, key, ns->start[ns->depth-1]);
+        chanstat[channel].stuck++;
+        noteOff(channel, key, now);
+      }
+    }
+  }
+}
+
+// Note ends sort before note starts at the same time, so back-to-back
+// notes do not count as overlapping.  The end of a note that started at
+// the same time goes after the starts, the count can't go below zero
+int compareEdges(const void* a, const void* b)
+{
+  const NOTEEDGE* ea = a;
+  const NOTEEDGE* eb = b;
+  if (ea->time != eb->time) return ea->time < eb->time ? -1 : 1;
+  return ea->rank - eb->rank;
+}
+
+// Walk the note edges in time order to find the peak polyphony
+void sweepPolyphony(void)
+{
+  uint16_t sounding = 0;
+
+  // a single track is in time order already, but not ends before starts
+  qsort(noteedges, nedges, sizeof(NOTEEDGE), compareEdges);
+
+  for (uint32_t i=0; i<nedges; i++)
+  {
+    CHANSTAT* cs = &chanstat[noteedges[i].channel];
+    cs->sounding += noteedges[i].delta;
+    sounding += noteedges[i].delta;
+    if (cs->sounding > cs->peak) cs->peak = cs->sounding;
+    if (sounding > peakAll) peakAll = sounding;
+  }
+}
+
+void printPolyphony(uint32_t songLength)
+{
+  printf("\nPOLYPHONY (%d ms)\n", songLength);
+  printf("chan  notes  stuck  peak   avg  min/avg/max duration (ms)\n");
+  for (uint8_t channel=0; channel<16; channel++)
+  {
+    CHANSTAT* cs = &chanstat[channel];
+    if (!cs->notes && !cs->orphans && !cs->overflows) continue;
+
+    printf("%4d %6d %6d %5d %5.2f  %d/%d/%d\n", channel+1, cs->notes, cs->stuck, cs->peak,
+      songLength ? (double)cs->sumDuration / songLength : 0.0,
+      cs->minDuration, cs->notes ? (uint32_t)(cs->sumDuration / cs->notes) : 0, cs->maxDuration);
+    if (cs->orphans) printf("     %d note-offs without note-on\n", cs->orphans);
+    if (cs->overflows) printf("     %d note-ons over %d deep on one key ignored\n", cs->overflows, maxstack);
+  }
+  printf("Peak polyphony: %d\n", peakAll);
+}
+
+
+// TEMPO MAP
+// Tempo changes from all tracks sorted by tick.  "acc" is the sum of
+// ticks * tempo up to the change, so any tick converts to microseconds
+// with a single division and no rounding drift.
+typedef struct
+{
+  uint32_t tick;
+  uint32_t tempo;
+  uint64_t acc;
+} TEMPOCHANGE;
+
+typedef struct
+{
+  uint32_t tick;
+  uint8_t  num;
+  uint8_t  den;   // as a power of 2
+} TIMESIG;
+
+TEMPOCHANGE* tempomap = NULL;
+uint32_t ntempo = 0;
+uint32_t maxtempo = 0;
+uint32_t tempoIdx = 0;
+
+TIMESIG* timesigs = NULL;
+uint32_t ntimesig = 0;
+uint32_t maxtimesig = 0;
+
+// Insert keeping tick order, later entries at the same tick go last
+void addTempo(uint32_t tick, uint32_t value)
+{
+  uint32_t i;
+  tempomap = growArray(tempomap, ntempo, &maxtempo, sizeof(TEMPOCHANGE));
+  for (i=ntempo; i>0 && tempomap[i-1].tick > tick; i--) tempomap[i] = tempomap[i-1];
+  tempomap[i].tick = tick;
+  tempomap[i].tempo = value;
+  ntempo++;
+}
+
+void addTimeSignature(uint32_t tick, uint8_t num, uint8_t den)
+{
+  uint32_t i;
+  timesigs = growArray(timesigs, ntimesig, &maxtimesig, sizeof(TIMESIG));
+  for (i=ntimesig; i>0 && timesigs[i-1].tick > tick; i--) timesigs[i] = timesigs[i-1];
+  timesigs[i].tick = tick;
+  timesigs[i].num = num;
+  timesigs[i].den = den;
+  ntimesig++;
+}
+
+void buildTempoMap(void)
+{
+  tempomap[0].acc = 0;
+  for (uint32_t i=1; i<ntempo; i++)
+  {
+    tempomap[i].acc = tempomap[i-1].acc + (uint64_t)(tempomap[i].tick - tempomap[i-1].tick) * tempomap[i-1].tempo;
+  }
+}
+
+// Ticks to microseconds.  Queries within a track are in increasing tick
+// order so the lookup only moves forward; tempoIdx is reset per track.
+uint64_t tickToUS(uint32_t tick)
+{
+  if (midiheader.division & 0x8000)
+  {
+    // SMPTE: -frames per second in the high byte, ticks per frame in the low byte
+    uint64_t fps = -(int8_t)(midiheader.division >> 8);
+    uint64_t tpf = midiheader.division & 0xFF;
+    if (fps == 29) return (uint64_t)tick * 1001000000 / (30000 * tpf);
+    return (uint64_t)tick * 1000000 / (fps * tpf);
+  }
+
+  while (tempoIdx+1 < ntempo && tempomap[tempoIdx+1].tick <= tick) tempoIdx++;
+  while (tempoIdx > 0 && tempomap[tempoIdx].tick > tick) tempoIdx--;
+
+  TEMPOCHANGE* tc = &tempomap[tempoIdx];
+  return (tc->acc + (uint64_t)(tick - tc->tick) * tc->tempo) / midiheader.division;
+}
+
+void printTime(uint64_t us)
+{
+  printf("%d:%02d.%06d", (int)(us / 60000000), (int)(us / 1000000 % 60), (int)(us % 1000000));
+}
+
+// One line per bar, bar lengths from the time signatures
+void printBars(void)
+{
+  uint32_t tick = 0;
+  uint32_t bar = 1;
+  uint32_t sig = 0;
+  uint8_t num = 4, den = 2;
+
+  // bars are meaningless with SMPTE timing
+  if (midiheader.division & 0x8000) return;
+
+  printf("\nTIMELINE\n");
+  tempoIdx = 0;
+  while (tick < endTick)
+  {
+    uint32_t length, next;
+
+    while (sig < ntimesig && timesigs[sig].tick <= tick)
+    {
+      num = timesigs[sig].num;
+      den = timesigs[sig].den;
+      sig++;
+    }
+
+    length = ((uint32_t)num * midiheader.division * 4) >> den;
+    if (!length) length = midiheader.division * 4;
+
+    printf("Bar %d @ ", bar);
+    printTime(tickToUS(tick));
+    printf(" %d/%d\n", num, 1 << den);
+
+    // a signature change in the middle of a bar starts a new one
+    next = tick + length;
+    if (sig < ntimesig && timesigs[sig].tick < next) next = timesigs[sig].tick;
+    tick = next;
+    bar++;
+  }
+}
+
+void rewindMidi(void)
+{
+  fseek(midiFile, 0, SEEK_SET);
+  sdDatIdx = 255;
+  dpos = -1;
+}
+
+// BUFFERED OUTPUT
+// JSON and binary output go through one large buffer and a raw write(),
+// a full event dump must not cost a printf per field
+#define outsize 65536
+uint8_t  outbuf[outsize];
+uint32_t outpos = 0;
+int      outfd  = 1;
+uint8_t  firstItem = 1;
+
+void outFlush(void)
+{
+  uint32_t done = 0;
+  while (done < outpos)
+  {
+    ssize_t n = write(outfd, outbuf + done, outpos - done);
+    if (n <= 0) {
+      perror("write");
+      exit(1);
+    }
+    done += n;
+  }
+  midiStats.bytesOut += outpos;
+  outpos = 0;
+}
+
+static inline void outByte(uint8_t b)
+{
+  if (outpos == outsize) outFlush();
+  outbuf[outpos++] = b;
+}
+
+void outStr(const char* str)
+{
+  while (*str) outByte(*str++);
+}
+
+void outUint(uint64_t v)
+{
+  char digits[20];
+  int n = 0;
+  do
+  {
+    digits[n++] = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  while (n) outByte(digits[--n]);
+}
+
+// Little endian value of n bytes, for the binary records
+void outLE(uint64_t v, uint8_t n)
+{
+  while (n--)
+  {
+    outByte(v & 0xFF);
+    v >>= 8;
+  }
+}
+
+// JSON text with the bytes taken as Latin-1, which is what most files use
+void outJsonString(const uint8_t* p, uint32_t n)
+{
+  static const char hex[] = "0123456789abcdef";
+  outByte('"');
+  while (n--)
+  {
+    uint8_t c = *p++;
+    if (c == '"' || c == '\\') {
+      outByte('\\');
+      outByte(c);
+    }
+    else if (c < 0x20 || c >= 0x7F) {
+      outStr("\\u00");
+      outByte(hex[c >> 4]);
+      outByte(hex[c & 15]);
+    }
+    else outByte(c);
+  }
+  outByte('"');
+}
+
+// "name": with the comma when it is not the first item of an object or list
+void outKey(const char* name)
+{
+  if (!firstItem) outByte(',');
+  firstItem = 0;
+  outByte('"');
+  outStr(name);
+  outStr("\":");
+}
+
+void outKeyUint(const char* name, uint64_t v)
+{
+  outKey(name);
+  outUint(v);
+}
+
+void outOpen(char c)
+{
+  outByte(c);
+  firstItem = 1;
+}
+
+void outItem(void)
+{
+  if (!firstItem) outByte(',');
+  firstItem = 0;
+}
+
+// BINARY RECORDS
+// The file starts with "MIB1", then records of
+//   uint8 type, uint16 payload length, payload
+// all values little endian:
+//   'H' format u16, ntracks u16, division u16
+//   'T' tick u32, tempo u32, us u64
+//   'S' tick u32, numerator u8, denominator (power of 2) u8
+//   'K' track u16, length u32
+//   'E' track u16, tick u32, us u64, status u8, meta type u8, length u32, data
+//   'k' track u16, events u32, end tick u32, end us u64, name
+//   'Z' duration us u64, end tick u32, events u32, peak polyphony u16, then
+//       per channel notes u32, stuck u32, peak u16, min ms u32, max ms u32, sum ms u64
+void outRecord(uint8_t type, uint16_t length)
+{
+  outByte(type);
+  outLE(length, 2);
+}
+
 // length is tracked by midi reader so we don't need to do it here
 //
 uint8_t SDgetc(void)
@@ -152,7 +606,8 @@ uint8_t SDgetc(void)
   ++sdDatIdx;
   sdDatIdx &= 255;
   if (sdDatIdx == 0) {
-    fread(sdData, 1, 256, midiFile);
+    midiStats.bytesIn += fread(sdData, 1, 256, midiFile);
+    midiStats.refills++;
   }
 
   dpos++;
@@ -212,14 +667,16 @@ uint8_t readTrackByte(void)
 uint32_t readVariableLength()
 {
   uint32_t v = 0;
-  uint8_t c;
+  uint8_t c, n = 1;
   c = readTrackByte();
   v = c & 0x7F;
   while (c & 0x80)
   {
     c = readTrackByte();
     v = (v << 7) | (c & 0x7F);
+    n++;
   }
+  statVLQ(n);
   return v;
 }
 
@@ -264,9 +721,12 @@ uint8_t readHeaderChunk(void)
   midiheader.ntracks  = read16();
   midiheader.division = read16();
 
-  printf("Format: type %0d\n", midiheader.format);
-  printf("Tracks: %0d\n", midiheader.ntracks);
-  printf("Division: %0d\n", midiheader.division);
+  if (printing)
+  {
+    printf("Format: type %0d\n", midiheader.format);
+    printf("Tracks: %0d\n", midiheader.ntracks);
+    printf("Division: %0d\n", midiheader.division);
+  }
 
   tempo = 500000; // Default tempo : 500000 microsec / beat
 
@@ -282,13 +742,17 @@ uint8_t readTrackChunk(void)
   return miditrack.chk[0]=='M' && miditrack.chk[1]=='T' && miditrack.chk[2]=='r' && miditrack.chk[3]=='k' ? NoError : badTrackheader;
 }
 
-uint32_t realTime = 0;
+// Print a text meta event, the data is not zero terminated
+void printText(const char* what)
+{
+  uint32_t n = midievent.nbdata < maxdata ? midievent.nbdata : maxdata;
+  printf("%s: %.*s\n", what, (int)n, (const char*)midievent.data);
+}
 
 // Read MIDI file track event
 uint8_t readTrackEvent(void)
 {
   uint8_t c;
-  uint32_t ms, us;
 
   // Read time
   midievent.wait = readVariableLength();
@@ -296,36 +760,57 @@ uint8_t readTrackEvent(void)
   // Read track event
   midievent.event = readTrackByte();
 
-  // Calculate next time on which data shall be played
-
-  ms = (midievent.wait * tempo) / (midiheader.division * 1000);
-  us = midievent.wait * tempo / midiheader.division;
-  nextTimeMS += ms;
-  nextTimeUS += us;
-
-  if (nextTimeMS > realTime) {
-    realTime = nextTimeMS;
-  } 
+  // Absolute time of this event, from the tempo map of the whole file
+  trackTick += midievent.wait;
+  if (reporting)
+  {
+    nowUS = tickToUS(trackTick);
+    nowMS = nowUS / 1000;
+  }
 
   if (midievent.event == 0xFF)
   {
     // Meta event
     // read Meta event type
     midievent.mtype = readTrackByte();
-    //printf("\nmeta event %d", midievent.mtype);
 
     // read data length
     midievent.nbdata = readVariableLength();
     // read data
     readNdata(0);
 
-    switch(midievent.mtype) {
-      case 3: {
-        printf("Track Name: %s\n", (const char*)&midievent.data);
+    if (!reporting)
+    {
+      if (midievent.mtype == MF_Meta_Tempo) addTempo(trackTick, midievent.data[0] * 65536 + midievent.data[1] * 256 + midievent.data[2]);
+      if (midievent.mtype == MF_Meta_Time_signature) addTimeSignature(trackTick, midievent.data[0], midievent.data[1]);
+      return NoError;
+    }
+
+    if (midievent.mtype == MF_Meta_Track_name)
+    {
+      trackNameLength = midievent.nbdata < maxdata ? midievent.nbdata : maxdata;
+      memcpy(trackName, midievent.data, trackNameLength);
+    }
+
+    if (printing) switch(midievent.mtype) {
+      case MF_Meta_Track_name: {
+        printText("Track Name");
+        break;
+      }
+      case MF_Meta_Marker: {
+        printf("Marker @ ");
+        printTime(nowUS);
+        printText("");
+        break;
+      }
+      case MF_Meta_Cue_point: {
+        printf("Cue point @ ");
+        printTime(nowUS);
+        printText("");
         break;
       }
-      case 88: {
-        printf("Time Signature: %d/%d\n", midievent.data[0],(int)pow(midievent.data[1],2));
+      case MF_Meta_Time_signature: {
+        printf("Time Signature: %d/%d\n", midievent.data[0], 1 << midievent.data[1]);
         break;
       }
     }
@@ -339,7 +824,7 @@ uint8_t readTrackEvent(void)
 
       bpm = 60000000 / tempo;
 
-      printf("BPM change: %d (%d)\n", bpm, tempo);
+      if (printing) printf("BPM change: %d (%d) @ %d\n", bpm, tempo, nowMS);
    }
   }
   else if (midievent.event == 0XF0 || midievent.event == 0xF7)
@@ -357,8 +842,8 @@ uint8_t readTrackEvent(void)
   {
     // Midi event
     runningEvent = midievent.event;
-    if ((midievent.event & 0xf0) == 0x90) {
-      printf("Note @ %d\n", realTime);
+    if (printing && (midievent.event & 0xf0) == 0x90) {
+      printf("Note @ %d\n", nowMS);
     }
     // calculate the number of  data bytes
     midievent.nbdata = ((midievent.event & 0xE0) == 0xC0 ? 1 : 2);
@@ -367,8 +852,8 @@ uint8_t readTrackEvent(void)
   }
   else
   {
-    //printf("\nrunning event (%06x, %06x)", dpos, bc);
     // Running event
+    midiStats.runningStatus++;
     // transfer first byte from event to data
     midievent.data[0] = midievent.event;
     // recall last event value
@@ -379,20 +864,281 @@ uint8_t readTrackEvent(void)
     readNdata(1);
   }
 
-/*
-  if (midievent.wait) {
-    printf("tempo %08x  wait %08x  division %08x\n", tempo, midievent.wait, midiheader.division);
-    printf("  ms  %04x (%08x)\n", ms, nextTimeMS);
-    printf("  us  %04x (%08x)\n", us, nextTimeUS);
-    printf("           (%08x)\n", nextTimeUS/1000);
+  statEvent(midievent.event, midievent.mtype, midievent.nbdata);
+
+  // Pair notes, a Note On with velocity 0 is a Note Off
+  if (!reporting) return NoError;
+
+  trackEvents++;
+  totalEvents++;
+  if (outputMode != textOutput) emitEvent(trackIndex);
+
+  if ((midievent.event & 0xE0) == 0x80)
+  {
+    uint8_t channel = midievent.event & 0x0F;
+    uint8_t key = midievent.data[0] & 0x7F;
+    if ((midievent.event & 0xF0) == 0x90 && midievent.data[1]) noteOn(channel, key, nowMS);
+    else noteOff(channel, key, nowMS);
   }
-*/
+
   return NoError;
 }
 
 
+// Event classes used by the filter, meta events are class 0
+uint8_t eventClass(uint8_t status)
+{
+  return status == 0xFF ? 0 : status >> 4;
+}
+
+uint8_t eventSelected(void)
+{
+  if (!(classFilter & (1 << eventClass(midievent.event)))) return 0;
+  if (channelFilter == 0xFFFF) return 1;
+  return midievent.event < 0xF0 && (channelFilter & (1 << (midievent.event & 0x0F)));
+}
+
+// A later tempo at the same tick wins, such as the file's own tempo over the default
+uint8_t tempoSuperseded(uint32_t i)
+{
+  return i+1 < ntempo && tempomap[i+1].tick == tempomap[i].tick;
+}
+
+void emitHeader(void)
+{
+  if (outputMode == jsonOutput)
+  {
+    outOpen('{');
+    outKeyUint("format", midiheader.format);
+    outKeyUint("tracks", midiheader.ntracks);
+    outKeyUint("division", midiheader.division);
+
+    outKey("tempo");
+    outOpen('[');
+    for (uint32_t i=0; i<ntempo; i++)
+    {
+      if (tempoSuperseded(i)) continue;
+      outItem();
+      outOpen('{');
+      outKeyUint("tick", tempomap[i].tick);
+      outKeyUint("us", tickToUS(tempomap[i].tick));
+      outKeyUint("tempo", tempomap[i].tempo);
+      outByte('}');
+      firstItem = 0;
+    }
+    outByte(']');
+    firstItem = 0;
+
+    outKey("timesig");
+    outOpen('[');
+    for (uint32_t i=0; i<ntimesig; i++)
+    {
+      outItem();
+      outOpen('{');
+      outKeyUint("tick", timesigs[i].tick);
+      outKeyUint("num", timesigs[i].num);
+      outKeyUint("den", 1 << timesigs[i].den);
+      outByte('}');
+      firstItem = 0;
+    }
+    outByte(']');
+    firstItem = 0;
+
+    outKey("track");
+    outOpen('[');
+  }
+  else
+  {
+    outStr("MIB1");
+    outRecord('H', 6);
+    outLE(midiheader.format, 2);
+    outLE(midiheader.ntracks, 2);
+    outLE(midiheader.division, 2);
+    for (uint32_t i=0; i<ntempo; i++)
+    {
+      if (tempoSuperseded(i)) continue;
+      outRecord('T', 16);
+      outLE(tempomap[i].tick, 4);
+      outLE(tempomap[i].tempo, 4);
+      outLE(tickToUS(tempomap[i].tick), 8);
+    }
+    for (uint32_t i=0; i<ntimesig; i++)
+    {
+      outRecord('S', 6);
+      outLE(timesigs[i].tick, 4);
+      outByte(timesigs[i].num);
+      outByte(timesigs[i].den);
+    }
+  }
+  tempoIdx = 0;
+}
+
+void emitTrackStart(uint16_t track)
+{
+  if (outputMode == jsonOutput)
+  {
+    outItem();
+    outOpen('{');
+    outKeyUint("index", track);
+    outKeyUint("length", miditrack.length);
+    if (listEvents)
+    {
+      outKey("events");
+      outOpen('[');
+    }
+  }
+  else
+  {
+    outRecord('K', 6);
+    outLE(track, 2);
+    outLE(miditrack.length, 4);
+  }
+}
+
+void emitEvent(uint16_t track)
+{
+  uint32_t n = midievent.nbdata < maxdata ? midievent.nbdata : maxdata;
+
+  if (!listEvents || !eventSelected()) return;
+
+  if (outputMode == jsonOutput)
+  {
+    outItem();
+    outOpen('{');
+    outKeyUint("tick", trackTick);
+    outKeyUint("us", nowUS);
+    if (midievent.event == 0xFF)
+    {
+      outKeyUint("meta", midievent.mtype);
+      if (midievent.mtype >= MF_Meta_Text && midievent.mtype <= MF_Meta_Cue_point)
+      {
+        outKey("text");
+        outJsonString(midievent.data, n);
+      }
+    }
+    else
+    {
+      outKeyUint("status", midievent.event);
+      if (midievent.event < 0xF0) outKeyUint("ch", (midievent.event & 0x0F) + 1);
+    }
+    if (n != midievent.nbdata) outKeyUint("length", midievent.nbdata);
+    outKey("data");
+    outOpen('[');
+    for (uint32_t i=0; i<n; i++)
+    {
+      outItem();
+      outUint(midievent.data[i]);
+    }
+    outStr("]}");
+    firstItem = 0;
+  }
+  else
+  {
+    outRecord('E', 20 + n);
+    outLE(track, 2);
+    outLE(trackTick, 4);
+    outLE(nowUS, 8);
+    outByte(midievent.event);
+    outByte(midievent.event == 0xFF ? midievent.mtype : 0);
+    outLE(midievent.nbdata, 4);
+    for (uint32_t i=0; i<n; i++) outByte(midievent.data[i]);
+  }
+}
+
+void emitTrackEnd(uint16_t track)
+{
+  uint64_t us = tickToUS(trackTick);
+
+  if (outputMode == jsonOutput)
+  {
+    if (listEvents)
+    {
+      outByte(']');
+      firstItem = 0;
+    }
+    outKeyUint("eventCount", trackEvents);
+    outKeyUint("endTick", trackTick);
+    outKeyUint("endUS", us);
+    if (trackNameLength)
+    {
+      outKey("name");
+      outJsonString(trackName, trackNameLength);
+    }
+    outByte('}');
+    firstItem = 0;
+  }
+  else
+  {
+    outRecord('k', 18 + trackNameLength);
+    outLE(track, 2);
+    outLE(trackEvents, 4);
+    outLE(trackTick, 4);
+    outLE(us, 8);
+    for (uint32_t i=0; i<trackNameLength; i++) outByte(trackName[i]);
+  }
+}
+
+void emitSummary(void)
+{
+  if (outputMode == jsonOutput)
+  {
+    outByte(']');
+    firstItem = 0;
+    outKey("summary");
+    outOpen('{');
+    outKeyUint("durationUS", endUS);
+    outKeyUint("endTick", endTick);
+    outKeyUint("eventCount", totalEvents);
+    outKeyUint("peakPolyphony", peakAll);
+    outKey("channels");
+    outOpen('[');
+    for (uint8_t channel=0; channel<16; channel++)
+    {
+      CHANSTAT* cs = &chanstat[channel];
+      char avg[32];
+      if (!cs->notes) continue;
+
+      snprintf(avg, sizeof(avg), "%.3f", endUS ? (double)cs->sumDuration * 1000 / endUS : 0.0);
+      outItem();
+      outOpen('{');
+      outKeyUint("channel", channel+1);
+      outKeyUint("notes", cs->notes);
+      outKeyUint("stuck", cs->stuck);
+      outKeyUint("peak", cs->peak);
+      outKey("avgPolyphony");
+      outStr(avg);
+      outKeyUint("minMS", cs->minDuration);
+      outKeyUint("avgMS", cs->sumDuration / cs->notes);
+      outKeyUint("maxMS", cs->maxDuration);
+      outByte('}');
+      firstItem = 0;
+    }
+    outStr("]}}\n");
+  }
+  else
+  {
+    outRecord('Z', 18 + 16 * 26);
+    outLE(endUS, 8);
+    outLE(endTick, 4);
+    outLE(totalEvents, 4);
+    outLE(peakAll, 2);
+    for (uint8_t channel=0; channel<16; channel++)
+    {
+      CHANSTAT* cs = &chanstat[channel];
+      outLE(cs->notes, 4);
+      outLE(cs->stuck, 4);
+      outLE(cs->peak, 2);
+      outLE(cs->minDuration, 4);
+      outLE(cs->maxDuration, 4);
+      outLE(cs->sumDuration, 8);
+    }
+  }
+  outFlush();
+}
+
+
 // Read MIDI file (main part)
-void readMidi(void)
+uint8_t readMidi(void)
 {
   uint16_t i;
   uint8_t err;
@@ -402,33 +1148,168 @@ void readMidi(void)
 
   // Read File header Chunk
   err = readHeaderChunk();
+  if (!err && reporting && outputMode != textOutput) emitHeader();
 
   // Read succesive Tracks
   for (i=1; i<=midiheader.ntracks && !err; i++)
   {
-    printf("\nTRACK %d\n", i);
+    if (printing) printf("\nTRACK %d\n", i);
     // Read track header Chunk
     err = readTrackChunk();
+    if (err) break;
+
+    // every track starts at tick 0
+    trackIndex = i;
+    trackTick = 0;
+    tempoIdx = 0;
+    runningEvent = 0;
+    trackEvents = 0;
+    trackNameLength = 0;
+    if (reporting && outputMode != textOutput) emitTrackStart(i);
 
     // Read succesive Events
     for (tpos=0; tpos < miditrack.length && !err;) 
 		{
 			err = readTrackEvent();
 		}
+
+    if (trackTick > endTick) endTick = trackTick;
+    if (reporting)
+    {
+      closeHangingNotes(nowMS);
+      if (outputMode != textOutput) emitTrackEnd(i);
+    }
   }
+  return err;
+}
+
+
+// Parse a -t argument into a class filter bit
+uint16_t classBits(const char* name)
+{
+  if (!strcmp(name, "meta"))  return 1 << 0;
+  if (!strcmp(name, "note"))  return (1 << 0x8) | (1 << 0x9);
+  if (!strcmp(name, "poly"))  return 1 << 0xA;
+  if (!strcmp(name, "ctrl"))  return 1 << 0xB;
+  if (!strcmp(name, "prog"))  return 1 << 0xC;
+  if (!strcmp(name, "press")) return 1 << 0xD;
+  if (!strcmp(name, "bend"))  return 1 << 0xE;
+  if (!strcmp(name, "sysex")) return 1 << 0xF;
+  return 0;
+}
+
+int usage(void)
+{
+  puts("usage: midinfo [-j | -b] [-e] [-t class]... [-c channel]... [-o file] [--stats[=json]] file.mid");
+  puts("  -j  JSON output");
+  puts("  -b  binary record output");
+  puts("  -e  include the events");
+  puts("  -t  only events of class meta, note, poly, ctrl, prog, press, bend or sysex");
+  puts("  -c  only channel events of channel 1-16");
+  puts("  -o  write to file instead of stdout");
+  puts("  --stats  parser counters on stderr, =json for one JSON line");
+  return 1;
 }
 
+// what the report read, parseExit + its error if it stopped short
+int exitStatus(uint8_t err)
+{
+  if (!err) return 0;
+  fprintf(stderr, "error %d reading input file.\n", err);
+  return parseExit + err;
+}
 
 int main(int argc, char** argv)
 {
-  midiFile = fopen(argv[1], "rb");
+  int opt;
+  uint8_t err;
+  const char* outname = NULL;
+
+  static const struct option longOptions[] = {
+    { "stats", optional_argument, NULL, 256 },
+    { NULL, 0, NULL, 0 }
+  };
+
+  while ((opt = getopt_long(argc, argv, "jbet:c:o:", longOptions, NULL)) != -1)
+  {
+    switch (opt)
+    {
+      case 256: if (!statOption(optarg)) return usage(); break;
+      case 'j': outputMode = jsonOutput; break;
+      case 'b': outputMode = binaryOutput; break;
+      case 'e': listEvents = 1; break;
+      case 't': {
+        uint16_t bits = classBits(optarg);
+        if (!bits) return usage();
+        classFilter = (classFilter == 0xFFFF ? 0 : classFilter) | bits;
+        break;
+      }
+      case 'c': {
+        int channel = atoi(optarg);
+        if (channel < 1 || channel > 16) return usage();
+        channelFilter = (channelFilter == 0xFFFF ? 0 : channelFilter) | (1 << (channel - 1));
+        break;
+      }
+      case 'o': outname = optarg; break;
+      default: return usage();
+    }
+  }
+  if (optind >= argc) return usage();
+
+  midiFile = fopen(argv[optind], "rb");
   if (!midiFile) {
     puts("can't open input file.");
     return 1;
   }
 
-  readMidi();
+  if (outname)
+  {
+    if (!freopen(outname, "wb", stdout)) {
+      puts("can't open output file.");
+      return 1;
+    }
+    outfd = fileno(stdout);
+  }
+
+  // Pass 1: tempo and time signature maps of the whole file
+  statBegin(0, "scan");
+  addTempo(0, 500000);
+  err = readMidi();
+  // nothing to report without a header, the division may be 0
+  if (err == badFileheader) return exitStatus(err);
+  buildTempoMap();
+  statEnd(0);
+
+  // Pass 2: report with exact times, counted again from the start
+  statReset();
+  statBegin(1, "report");
+  rewindMidi();
+  reporting = 1;
+  printing = outputMode == textOutput;
+  err = readMidi();
   allSoundOff();
 
-  return 0;
+  endUS = tickToUS(endTick);
+  sweepPolyphony();
+
+  if (!printing)
+  {
+    emitSummary();
+    statEnd(1);
+    statPrint(stderr);
+    return exitStatus(err);
+  }
+
+  printBars();
+
+  printf("\nDuration: %llu us (", (unsigned long long)endUS);
+  printTime(endUS);
+  printf(")\n");
+
+  printPolyphony(endUS / 1000);
+
+  fflush(stdout);
+  statEnd(1);
+  statPrint(stderr);
+  return exitStatus(err);
 }
@@ -0,0 +1,263 @@
+// midipack: pack a MIDI file into the MLZ1 container read by tinymidiplay
+//   gcc -O2 -o midipack midipack.c
+//
+// The container is a 14 byte header, the same size as MThd so the player
+// reads it with readHeaderChunk():
+//   "MLZ1", uint32 unpacked length, uint16 format, ntracks, division
+// followed by the whole original file as a stream of tokens:
+//   0x00-0x7F  literal run, (token + 1) bytes follow
+//   0x80-0xFF  match of (token & 0x7F) + 3 bytes, one distance byte
+//              follows, 1-255 back or 0 for 256 back
+// Matches only reach back 256 bytes, so the Z80 keeps its whole window
+// in one page and wraps the index for free.
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define window   256
+#define minmatch 3
+#define maxmatch 130
+#define maxlit   128
+
+// exit status of a file that isn't MIDI, parseExit + badFileheader as
+// the parsers use
+#define notMidiExit 11
+
+// Z80 cost model, T-states per unpacked byte counted from the listing of
+// SDgetc in backend_zx81.h, call and ret included, refills left out:
+//   sdgetraw                114
+//   sdgetlz literal byte    266, +135 for the token that starts its run
+//   sdgetlz match byte      234, +276 for the token and its distance
+//   useCompressed()        5484, mostly the 256 byte ldir (255*21+16)
+// Counted, not timed.  A ZX81 spends most of each frame on the display
+// in SLOW mode, so a byte takes longer than tPerUS says; -b gives the
+// time the PROFILE build measures (its B setting) and scales them all.
+#define tRawByte      114
+#define tLiteralByte  266
+#define tMatchByte    234
+#define tLiteralToken 135
+#define tMatchToken   276
+#define tSwitch       5484
+#define tCallRet      27      // the part of tRawByte B takes off, see benchReads() in tinymidiplay.c
+#define tPerUS        3.25    // 3.25MHz Z80
+
+// Measured on the machine with the PROFILE build's B setting, there are
+// no defaults: without -r nothing is written unless -f, and the read
+// time where packing starts to pay is printed to check against.
+uint32_t blockReadUS = 0;     // -r, a 256 byte ZXpand read
+uint32_t rawKiloUS = 0;       // -b, 1000 plain bytes less tCallRet each
+
+uint8_t* in;
+uint32_t nin;
+uint8_t* out;
+uint32_t nout;
+
+uint32_t literalTokens = 0;
+uint32_t matchTokens = 0;
+uint32_t literalBytes = 0;
+uint32_t matchBytes = 0;
+
+
+void flushLiterals(uint32_t from, uint32_t to)
+{
+  while (from < to)
+  {
+    uint32_t n = to - from > maxlit ? maxlit : to - from;
+    out[nout++] = n - 1;
+    memcpy(&out[nout], &in[from], n);
+    nout += n;
+    from += n;
+    literalTokens++;
+    literalBytes += n;
+  }
+}
+
+// Greedy parse, the window is small enough to search exhaustively
+void pack(void)
+{
+  uint32_t pos = 0;
+  uint32_t literalStart = 0;
+
+  out[nout++] = 'M';
+  out[nout++] = 'L';
+  out[nout++] = 'Z';
+  out[nout++] = '1';
+  out[nout++] = nin >> 24;
+  out[nout++] = nin >> 16;
+  out[nout++] = nin >> 8;
+  out[nout++] = nin;
+  memcpy(&out[nout], &in[8], 6);
+  nout += 6;
+
+  while (pos < nin)
+  {
+    uint32_t bestLength = 0, bestDistance = 0;
+
+    for (uint32_t distance=1; distance<=window && distance<=pos; distance++)
+    {
+      uint32_t length = 0;
+      while (length < maxmatch && pos + length < nin && in[pos + length - distance] == in[pos + length]) length++;
+      if (length > bestLength)
+      {
+        bestLength = length;
+        bestDistance = distance;
+      }
+    }
+
+    if (bestLength < minmatch)
+    {
+      pos++;
+      continue;
+    }
+
+    flushLiterals(literalStart, pos);
+    out[nout++] = 0x80 | (bestLength - minmatch);
+    out[nout++] = bestDistance & 0xFF;
+    matchTokens++;
+    matchBytes += bestLength;
+    pos += bestLength;
+    literalStart = pos;
+  }
+  flushLiterals(literalStart, pos);
+}
+
+// Same steps as sdgetlz, with the window as a 256 byte ring
+uint8_t unpackMatches(void)
+{
+  uint8_t ring[window];
+  uint8_t ringOut = 0;
+  uint32_t pos = 14, n = 0;
+
+  while (n < nin)
+  {
+    uint8_t token = out[pos++];
+    if (token < 0x80)
+    {
+      for (int i=0; i<=token; i++)
+      {
+        uint8_t c = out[pos++];
+        ring[ringOut++] = c;
+        if (c != in[n++]) return 0;
+      }
+    }
+    else
+    {
+      uint8_t src = ringOut - out[pos++];
+      for (int i=0; i<(token & 0x7F) + minmatch; i++)
+      {
+        uint8_t c = ring[src++];
+        ring[ringOut++] = c;
+        if (c != in[n++]) return 0;
+      }
+    }
+  }
+  return pos == nout;
+}
+
+uint32_t blocks(uint32_t bytes)
+{
+  return (bytes + 255) / 256;
+}
+
+int usage(void)
+{
+  puts("usage: midipack [-f] [-r us] [-b us] input.mid output");
+  puts("  -f  write the packed file even when it plays slower");
+  puts("  -r  time of one 256 byte ZXpand read in microseconds");
+  puts("  -b  time of 1000 plain bytes in microseconds");
+  puts("  both as tinymidiplay-profile prints them with the B setting");
+  return 1;
+}
+
+int main(int argc, char** argv)
+{
+  FILE* f;
+  int opt;
+  uint8_t force = 0;
+  double rawT, packedT, usPerT, breakEven;
+
+  while ((opt = getopt(argc, argv, "fr:b:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'f': force = 1; break;
+      case 'r': blockReadUS = atoi(optarg); break;
+      case 'b': rawKiloUS = atoi(optarg); break;
+      default: return usage();
+    }
+  }
+  if (optind + 2 != argc) return usage();
+
+  f = fopen(argv[optind], "rb");
+  if (!f) {
+    puts("can't open input file.");
+    return 1;
+  }
+  fseek(f, 0, SEEK_END);
+  nin = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  in = malloc(nin + 1);
+  // worst case is all literals
+  out = malloc(14 + nin + nin / maxlit + 1);
+  if (!in || !out || fread(in, 1, nin, f) != nin) {
+    puts("can't read input file.");
+    return 1;
+  }
+  fclose(f);
+
+  if (nin < 14 || memcmp(in, "MThd", 4)) {
+    puts("not a MIDI file.");
+    return notMidiExit;
+  }
+
+  pack();
+  if (!unpackMatches()) {
+    puts("internal error: packed data does not unpack to the input.");
+    return 2;
+  }
+
+  // Playback cost of reading the whole file both ways, without the block
+  // reads; B times SDgetc less a call to a bare ret
+  usPerT = rawKiloUS ? rawKiloUS / 1000.0 / (tRawByte - tCallRet) : 1 / tPerUS;
+  rawT = (double)nin * tRawByte;
+  packedT = tSwitch + (double)literalBytes * tLiteralByte + (double)matchBytes * tMatchByte
+          + (double)literalTokens * tLiteralToken + (double)matchTokens * tMatchToken;
+  breakEven = blocks(nout) < blocks(nin) ? (packedT - rawT) * usPerT / (blocks(nin) - blocks(nout)) : -1;
+
+  printf("Input:  %d bytes, %d blocks\n", nin, blocks(nin));
+  printf("Packed: %d bytes, %d blocks (%.1f%%)\n", nout, blocks(nout), 100.0 * nout / nin);
+  printf("  %d literal runs (%d bytes), %d matches (%d bytes)\n", literalTokens, literalBytes, matchTokens, matchBytes);
+  if (rawKiloUS) printf("Z80 time, with %d us per 1000 plain bytes:\n", rawKiloUS);
+  else puts("Z80 time, at 3.25MHz with no display:");
+  printf("  plain  %.0f ms + %d block reads\n", rawT * usPerT / 1000, blocks(nin));
+  printf("  packed %.0f ms + %d block reads\n", packedT * usPerT / 1000, blocks(nout));
+  if (breakEven < 0) puts("Packing saves no block reads.");
+  else printf("Packed is faster when a block read takes over %.0f us.\n", breakEven);
+
+  if (!blockReadUS && !force)
+  {
+    puts("No block read time to decide with, give it with -r (-f to write the packed file anyway).");
+    return 3;
+  }
+  if (blockReadUS)
+  {
+    rawT = rawT * usPerT + (double)blocks(nin) * blockReadUS;
+    packedT = packedT * usPerT + (double)blocks(nout) * blockReadUS;
+    printf("With %d us per block read: plain %.0f ms, packed %.0f ms\n", blockReadUS, rawT / 1000, packedT / 1000);
+    if (packedT >= rawT && !force)
+    {
+      puts("Packed file is not faster, keep the plain one (-f to write it anyway).");
+      return 3;
+    }
+  }
+
+  f = fopen(argv[optind+1], "wb");
+  if (!f || fwrite(out, 1, nout, f) != nout || fclose(f)) {
+    puts("can't write output file.");
+    return 1;
+  }
+  return 0;
+}
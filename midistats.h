@@ -0,0 +1,153 @@
+// Counters shared by the host tools, printed with --stats or --stats=json
+//
+// One set per translation unit, everything here is static, and the hooks
+// are plain increments so they stay in the parsers' hot paths.  Include
+// after <stdio.h>, <stdint.h> and <string.h>.
+
+#ifndef MIDISTATS_H
+#define MIDISTATS_H
+
+#include <time.h>
+
+#define nstatphases 4
+
+// STATS OUTPUT
+enum STATmodes
+{
+  noStats   = 0,
+  textStats = 1,
+  jsonStats = 2
+};
+
+typedef struct
+{
+  uint32_t classEvents[8];    // status 0x80..0xE0 by high nibble, then SysEx
+  uint32_t metaEvents[128];   // by meta type
+  uint32_t sysexBytes;
+  uint32_t runningStatus;     // channel events without a status byte
+  uint32_t vlqLength[5];      // variable length numbers of 1, 2, 3, 4 and more bytes
+  uint64_t bytesIn;
+  uint64_t bytesOut;
+  uint32_t refills;           // 256 byte blocks read, the SD card's on the ZX81
+  const char* phaseName[nstatphases];
+  uint64_t phaseNS[nstatphases];
+} MIDISTATS;
+
+static MIDISTATS midiStats;
+static uint8_t statsMode = noStats;
+static struct timespec statPhaseStart[nstatphases];
+
+static inline void statEvent(uint8_t status, uint8_t mtype, uint32_t nbdata)
+{
+  if (status == 0xFF) midiStats.metaEvents[mtype & 0x7F]++;
+  else if (status == 0xF0 || status == 0xF7)
+  {
+    midiStats.classEvents[7]++;
+    midiStats.sysexBytes += nbdata;
+  }
+  else midiStats.classEvents[(status >> 4) & 7]++;
+}
+
+static inline void statRunning(void)
+{
+  midiStats.runningStatus++;
+}
+
+static inline void statVLQ(uint8_t bytes)
+{
+  midiStats.vlqLength[bytes > 4 ? 4 : bytes - 1]++;
+}
+
+// Phase times add up over every begin/end pair, from any thread as long
+// as a phase is only timed by one.  Only with --stats, they call the clock.
+static inline void statBegin(uint8_t phase, const char* name)
+{
+  if (!statsMode) return;
+  midiStats.phaseName[phase] = name;
+  clock_gettime(CLOCK_MONOTONIC, &statPhaseStart[phase]);
+}
+
+static inline void statEnd(uint8_t phase)
+{
+  struct timespec now;
+  if (!statsMode) return;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  midiStats.phaseNS[phase] += (now.tv_sec - statPhaseStart[phase].tv_sec) * 1000000000LL + now.tv_nsec - statPhaseStart[phase].tv_nsec;
+}
+
+// Everything but the phase times, for tools that read the file twice
+static inline void statReset(void)
+{
+  uint64_t phaseNS[nstatphases];
+  const char* phaseName[nstatphases];
+
+  memcpy(phaseNS, midiStats.phaseNS, sizeof(phaseNS));
+  memcpy(phaseName, midiStats.phaseName, sizeof(phaseName));
+  memset(&midiStats, 0, sizeof(midiStats));
+  memcpy(midiStats.phaseNS, phaseNS, sizeof(phaseNS));
+  memcpy(midiStats.phaseName, phaseName, sizeof(phaseName));
+}
+
+static const char* statClassName[8] = { "noteOff", "noteOn", "polyPressure", "control", "program", "channelPressure", "pitchBend", "sysex" };
+
+// --stats or --stats=json
+static int statOption(const char* arg)
+{
+  if (!arg || !strcmp(arg, "text")) statsMode = textStats;
+  else if (!strcmp(arg, "json")) statsMode = jsonStats;
+  else return 0;
+  return 1;
+}
+
+static void statPrint(FILE* f)
+{
+  int first = 1;
+
+  if (!statsMode) return;
+  if (statsMode == jsonStats)
+  {
+    fprintf(f, "{\"events\":{");
+    for (int i=0; i<8; i++) fprintf(f, "%s\"%s\":%u", i ? "," : "", statClassName[i], midiStats.classEvents[i]);
+    fprintf(f, "},\"metas\":{");
+    for (int i=0; i<128; i++)
+    {
+      if (!midiStats.metaEvents[i]) continue;
+      fprintf(f, "%s\"%d\":%u", first ? "" : ",", i, midiStats.metaEvents[i]);
+      first = 0;
+    }
+    fprintf(f, "},\"sysexBytes\":%u,\"runningStatus\":%u,\"vlqLength\":[%u,%u,%u,%u,%u]",
+      midiStats.sysexBytes, midiStats.runningStatus, midiStats.vlqLength[0], midiStats.vlqLength[1],
+      midiStats.vlqLength[2], midiStats.vlqLength[3], midiStats.vlqLength[4]);
+    fprintf(f, ",\"bytesIn\":%llu,\"bytesOut\":%llu,\"refills\":%u,\"phaseUS\":{",
+      (unsigned long long)midiStats.bytesIn, (unsigned long long)midiStats.bytesOut, midiStats.refills);
+    first = 1;
+    for (int i=0; i<nstatphases; i++)
+    {
+      if (!midiStats.phaseName[i]) continue;
+      fprintf(f, "%s\"%s\":%llu", first ? "" : ",", midiStats.phaseName[i], (unsigned long long)(midiStats.phaseNS[i] / 1000));
+      first = 0;
+    }
+    fprintf(f, "}}\n");
+    return;
+  }
+
+  fprintf(f, "STATS\n");
+  for (int i=0; i<8; i++) fprintf(f, "%-16s %u\n", statClassName[i], midiStats.classEvents[i]);
+  for (int i=0; i<128; i++)
+  {
+    if (midiStats.metaEvents[i]) fprintf(f, "meta 0x%02X        %u\n", i, midiStats.metaEvents[i]);
+  }
+  fprintf(f, "sysex bytes      %u\n", midiStats.sysexBytes);
+  fprintf(f, "running status   %u\n", midiStats.runningStatus);
+  fprintf(f, "VLQ 1/2/3/4/5+   %u/%u/%u/%u/%u\n", midiStats.vlqLength[0], midiStats.vlqLength[1],
+    midiStats.vlqLength[2], midiStats.vlqLength[3], midiStats.vlqLength[4]);
+  fprintf(f, "bytes in         %llu\n", (unsigned long long)midiStats.bytesIn);
+  fprintf(f, "bytes out        %llu\n", (unsigned long long)midiStats.bytesOut);
+  fprintf(f, "refills          %u\n", midiStats.refills);
+  for (int i=0; i<nstatphases; i++)
+  {
+    if (midiStats.phaseName[i]) fprintf(f, "%-16s %llu us\n", midiStats.phaseName[i], (unsigned long long)(midiStats.phaseNS[i] / 1000));
+  }
+}
+
+#endif
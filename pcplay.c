@@ -1,400 +1,606 @@
 // based on https://community.atmel.com/projects/sd-card-midi-player
+//
+// pcplay: the host player with every output, midicore.h built against
+// per port batches that leave as plain bytes or timestamped records, an
+// output thread for real time, and the WAV synth.
 
 #include <stdio.h>
 #include <unistd.h>
 #include <stdint.h>
-
-// Controller
-#define MF_Bank_Select_MSB    0x00	// 0x00 .Bank Select MSB (value 0x50 : Preset A Patch 1..128, 0x51 Preset B Patch 129..255)
-#define MF_Bank_Select_LSB    0x20	// 0x20 .Bank Select LSB (value 0x00)
-#define MF_Modulation         0x01	// 0x01 .Modulation
-#define MF_Breath             0x02	// 0x02  Breath Controller
-#define MF_Foot               0x04	// 0x04  Foot Controller
-#define MF_Portamento_Time    0x05	// 0x05 .Portamento Time
-#define MF_Main_Volume        0x07	// 0x07 .Main Volume
-#define MF_Balance            0x08	// 0x08  Balance
-#define MF_Pan                0x0A	// 0x0A .Pan
-#define MF_Expression         0x0B	// 0x0B .Expression Controller
-#define MF_Effect_1           0x0C	// 0x0C  Effect Control 1
-#define MF_Effect_2           0x0D	// 0x0D  Effect Control 2
-#define MF_General_1to4       0x13	// 0x13  General-Purpose Controllers 1-4
-#define MF_Controller_LSB     0x3F	// 0x3F  LSB for controllers 0-31
-#define MF_Sustain            0x40	// 0x40 .Sustain(Damper pedal / Hold 1)
-#define MF_Portamento         0x41	// 0x41 .Portamento
-#define MF_Sostenuto          0x42	// 0x42 .Sostenuto
-#define MF_Soft               0x43	// 0x43 .Soft Pedal
-#define MF_Legato             0x44	// 0x44  Legato Footswitch
-#define MF_Hold               0x45	// 0x45  Hold 2
-#define MF_Control_1          0x46	// 0x46  Sound Controller 1 (default: Timber Variation)
-#define MF_Control_2          0x47	// 0x47  Sound Controller 2 (default: Timber/Harmonic Content)
-#define MF_Control_3          0x48	// 0x48  Sound Controller 3 (default: Release Time)
-#define MF_Control_4          0x49	// 0x49  Sound Controller 4 (default: Attack Time)
-#define MF_Portamento_Ctrl    0x54	// 0x54  Portamento Control
-#define MF_Reverb             0x5B	// 0x5B .Effects 1 Depth (M-GS64 : Reverb send level)
-#define MF_Effects_2          0x5C	// 0x5C  Effects 2 Depth (formerly Tremolo Depth)
-#define MF_Chorus             0x5D	// 0x5D .Effects 3 Depth (M-GS64 : Chorus send level)
-#define MF_Effects_4          0x5E	// 0x5E  Effects 4 Depth (formerly Celeste Detune)
-#define MF_Effects_5          0x5F	// 0x5F  Effects 5 Depth (formerly Phaser Depth)
-#define MF_Data_Increment     0x60	// 0x60  Data Increment
-#define MF_Data_Decrement     0x61	// 0x61  Data Decrement
-#define MF_NRPN_LSB           0x62	// 0x62 .Non-Registered Parameter Number (LSB)
-#define MF_NRPN_MSB           0x63	// 0x63 .Non-Registered Parameter Number (MSB)
-#define MF_RPN_LSB            0x64	// 0x64 .Registered Parameter Number (LSB)
-#define MF_RPN_MSB            0x65	// 0x65 .Registered Parameter Number (MSB)
-#define MF_Mode_Message       0x7F	// 0x7F  Mode Messages
-#define MF_Data_Entry_MSB     0x06	// 0x06  Data Entry (MSB)
-#define MF_Data_Entry_LSB     0x26	// 0x26  Data Entry (LSB)
-
-// MIDI File Formats
-#define MF_Single_track       0x00
-#define MF_Parallel_tracks    0x01
-#define MF_Sequential_tracks  0x02
-
-// Meta Events Type
-#define MF_Meta_Sequence         0x00  // Sequence number
-#define MF_Meta_Text             0x01  // Text event
-#define MF_Meta_Copyright        0x02  // Copyright
-#define MF_Meta_Track_name       0x03  // track name
-#define MF_Meta_Instrument_name  0x04  // Instrument name
-#define MF_Meta_Lyric            0x05  // Lyric text
-#define MF_Meta_Marker           0x06  // Marker text
-#define MF_Meta_Cue_point        0x07  // Cue point
-#define MF_Meta_MIDI_channel     0x20  // MIDI channel
-#define MF_Meta_MIDI_Port        0x21  // MIDI Port
-#define MF_Meta_Track_End        0x2F  // End of track
-#define MF_Meta_Tempo            0x51  // tempo setting
-#define MF_Meta_SMPTE_offset     0x54  // SMPTE offset
-#define MF_Meta_Time_signature   0x58  // Time signature
-#define MF_Meta_Key_signature    0x59  // Key signature
-#define MF_Meta_Special          0x7F  // Seq. special
-
-FILE* midiFile;
-
-// FILE header INFORMATION
-typedef struct
-{
-  uint8_t  chk[5];
-  uint32_t length;
-  uint16_t format;
-  uint16_t ntracks;
-  uint16_t division;
-} MTHD;
-
-// TRACK INFORMATION
-typedef struct
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+#include <getopt.h>
+#include "midistats.h"
+#include "synth.h"
+#include "backend_host.h"
+
+// OUTPUT BATCHING
+// All bytes due at the same time are collected and leave in one write().
+// With -t every batch is preceded by a record header:
+//   uint32 time (ms, little endian), uint16 length (little endian)
+#define batchsize 4096
+uint8_t  timestamped = 0;
+
+// OUTPUT PORTS
+// Every MIDI port has its own batch and its own output (-P port:file), so
+// each has its own 31250 baud link and 256 byte bucket.  A port without
+// an output plays on port 0, -o or stdout.
+#define maxports 16
+uint8_t  batch[maxports][batchsize];
+uint32_t batchLen[maxports];
+int      portFd[maxports] = { 1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1 };
+uint32_t outBytes = 0;
+
+#define portLive(p) (portFd[p] >= 0)
+#define portSlot(p) ((p) < maxports && portFd[p] >= 0 ? (p) : 0)
+
+// With -q (frameMS) events are grouped in buckets, each sent at the time
+// of its first event, and no bucket grows past the 256 byte ZXpand
+// buffer: what tinymidiplay sends for the same frameMS.
+#define bucketcap (frameMS ? 256 : batchsize)
+
+// STOPPING
+// Interrupted, or with -x at stopAt as if it had been.  Nothing at or
+// past the stop time goes out, so the stop sent at stopAt comes after
+// everything else.  Real time is kept by the output thread, the parser
+// never waits.
+volatile sig_atomic_t stopRequested = 0;
+uint32_t stopAt = 0;
+
+#define timeUp() (stopRequested || (stopAt && nextTime >= stopAt))
+#define waitUntil(due) 0
+#define stopKeys() 0
+#define textEvent()
+
+void MidiOut(uint8_t x);
+void midiOutBlock(uint8_t* msg);
+void flushMidi(void);
+
+#include "midicore.h"
+
+void writeAll(int fd, struct iovec* iov, int n)
 {
-  uint8_t  chk[5];
-  uint32_t length;
-} MTRK;
+  statBegin(1, "write");
+  while (n)
+  {
+    ssize_t done = writev(fd, iov, n);
+    if (done < 0) {
+      if (errno == EINTR) continue;
+      perror("write");
+      _exit(1);
+    }
+    while (n && (size_t)done >= iov->iov_len)
+    {
+      done -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n)
+    {
+      iov->iov_base = (uint8_t*)iov->iov_base + done;
+      iov->iov_len -= done;
+    }
+  }
+  statEnd(1);
+}
 
-// EVENT INFORMATION
-#define maxdata 127
-typedef struct
-{
-  uint32_t wait;
-  uint8_t  event;
-  uint8_t  mtype; // only for Meta Events
-  uint32_t nbdata;
-  uint8_t  data[maxdata];
-} MTEV;
-
-// RETURN CODES
-enum MIDIerrors
+void writeBatch(uint8_t port, uint32_t time, uint8_t* data, uint32_t len)
 {
-  NoError        = 0,
-  badFileheader  = 1,
-  badTrackheader = 2,
-  badEvent       = 3,
-  endOfFile      = 4,
-	userStop       = 5
-};
-
-// FUNCTIONS
-void     clearBuffer(void);
-uint8_t  readByte(void);
-uint8_t  readTrackByte(void);
-uint8_t  readHeaderChunk(void);
-uint8_t  readTrackChunk(void);
-uint16_t read16(void);
-uint32_t read32(void);
-uint32_t readVariableLength(void);
-uint8_t  readNdata(uint8_t start);
-uint8_t  readTrackEvent(void);
-void     allSoundOff(void);
-
-// Position in track
-uint32_t tpos     = 0;
-uint32_t prevpos  = 0;
-
-// LAST EVENT READ
-uint8_t runningEvent = 0;
-
-// TEMPO (microsec/beat)
-uint32_t tempo = 500000;
-
-// Shared variables
-MTHD midiheader;
-MTRK miditrack;
-MTEV midievent;
-
-uint32_t millis, nextTime = 0;
-int32_t dpos = -1;
-int sdDatIdx = 255;
-uint8_t sdData[256];
-
-// length is tracked by midi reader so we don't need to do it here
-//
-uint8_t SDgetc(void)
-{
-  ++sdDatIdx;
-  sdDatIdx &= 255;
-  if (sdDatIdx == 0) {
-    fread(sdData, 1, 256, midiFile);
+  uint8_t header[6];
+  struct iovec iov[2];
+  int n = 0;
+
+  if (timestamped)
+  {
+    header[0] = time;
+    header[1] = time >> 8;
+    header[2] = time >> 16;
+    header[3] = time >> 24;
+    header[4] = len;
+    header[5] = len >> 8;
+    iov[n].iov_base = header;
+    iov[n].iov_len = sizeof(header);
+    n++;
   }
+  iov[n].iov_base = data;
+  iov[n].iov_len = len;
+  n++;
 
-  dpos++;
-  return sdData[sdDatIdx];
+  writeAll(portFd[port], iov, n);
 }
 
-void MIDIinit(void)
+// REAL-TIME PLAYBACK
+// With -r the parser (main thread) hands each batch to the output thread
+// through a single producer / single consumer ring.  The output thread
+// sleeps until the absolute deadline of each slot, so wakeup errors never
+// accumulate, then writes it and records how late it was.
+#define ringslots 1024
+#define slotsize  256
+typedef struct
+{
+  uint32_t time;
+  uint16_t len;
+  uint8_t  port;
+  uint8_t  data[slotsize];
+} SLOT;
+
+SLOT ring[ringslots];
+atomic_uint ringHead = 0;   // written by the parser only
+atomic_uint ringTail = 0;   // written by the output thread only
+atomic_int  parserDone = 0;
+
+uint8_t  realtime = 0;
+uint32_t spinUS = 0;
+struct timespec startTime;
+
+// Lateness histogram, bucket n holds [2^(n-1), 2^n) microseconds
+#define jitterbuckets 20
+uint32_t jitterHist[jitterbuckets];
+uint32_t jitterCount = 0;
+int64_t  jitterMin = 0;
+int64_t  jitterMax = 0;
+int64_t  jitterSum = 0;
+
+void sleepShort(void)
 {
+  struct timespec ts = { 0, 200000 };
+  nanosleep(&ts, NULL);
 }
 
-int b = 16;
-
-void MidiOut(uint8_t x)
+void ringPush(uint8_t port, uint32_t time, uint8_t* data, uint32_t len)
 {
-  putc(x, stdout);
-}
+  unsigned head = atomic_load_explicit(&ringHead, memory_order_relaxed);
 
+  // the parser is far ahead of the clock, waiting here is normal
+  while (head - atomic_load_explicit(&ringTail, memory_order_acquire) == ringslots)
+  {
+    if (stopRequested) return;
+    sleepShort();
+  }
 
-// Read a 16 bits integer
-uint16_t read16(void)
-{
-  uint16_t v = SDgetc();
-  v = v * 256;
-  v += SDgetc();
-  return v;
+  SLOT* slot = &ring[head % ringslots];
+  slot->time = time;
+  slot->len = len;
+  slot->port = port;
+  memcpy(slot->data, data, len);
+  atomic_store_explicit(&ringHead, head + 1, memory_order_release);
 }
 
-
-// Read a 32 bits integer
-uint32_t read32(void)
+int64_t nanosSince(struct timespec* t)
 {
-  uint32_t v = SDgetc();
-  v *= 256;
-  v += SDgetc();
-  v *= 256;
-  v += SDgetc();
-  v *= 256;
-  v += SDgetc();
-  return v;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)(now.tv_sec - t->tv_sec) * 1000000000 + (now.tv_nsec - t->tv_nsec);
 }
 
-
-// Read a byte but stops if size of the track is excessed
-uint8_t readTrackByte(void)
+// Sleep until the deadline, optionally spinning through the last spinUS
+// microseconds to get under the scheduler's wakeup latency
+void sleepUntil(struct timespec* deadline)
 {
-  uint8_t c = 0;
-  if (tpos < miditrack.length)
+  struct timespec wake = *deadline;
+
+  if (spinUS)
   {
-    c = SDgetc();
-    tpos++;
+    int64_t ns = wake.tv_nsec - (int64_t)spinUS * 1000;
+    wake.tv_sec += ns / 1000000000;
+    ns %= 1000000000;
+    if (ns < 0) {
+      ns += 1000000000;
+      wake.tv_sec--;
+    }
+    wake.tv_nsec = ns;
+  }
+
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR)
+  {
+    if (stopRequested) return;
   }
-  return c;
-}
 
+  if (spinUS) while (nanosSince(deadline) < 0);
+}
 
-// Read a MIDI "variable length" integer
-uint32_t readVariableLength()
+void recordJitter(int64_t ns)
 {
-  uint32_t v = 0;
-  uint8_t c;
-  c = readTrackByte();
-  v = c & 0x7F;
-  while (c & 0x80)
+  int64_t us = ns / 1000;
+  int bucket = 0;
+
+  if (jitterCount == 0 || us < jitterMin) jitterMin = us;
+  if (jitterCount == 0 || us > jitterMax) jitterMax = us;
+  jitterSum += us;
+  jitterCount++;
+
+  while (us > 0 && bucket < jitterbuckets-1)
   {
-    c = readTrackByte();
-    v = (v << 7) | (c & 0x7F);
+    us >>= 1;
+    bucket++;
   }
-  return v;
+  jitterHist[bucket]++;
 }
 
-
-// Read "midievent.nbdata" bytes in "midievent.data[]" starting at "midievent.data[start]"
-// midievent.nbdata is not limited but we will store only "maxdata" and discard extra data
-uint8_t readNdata(uint8_t start)
+void* outputThread(void* arg)
 {
-  uint32_t i;
-  uint8_t c;
-  for (i=start; i<midievent.nbdata; i++)
+  (void)arg;
+
+  while (!stopRequested)
   {
-    c = readTrackByte();
-    if (i < maxdata) midievent.data[i] = c;
+    unsigned tail = atomic_load_explicit(&ringTail, memory_order_relaxed);
+    if (tail == atomic_load_explicit(&ringHead, memory_order_acquire))
+    {
+      if (atomic_load(&parserDone)) break;
+      sleepShort();
+      continue;
+    }
+
+    SLOT* slot = &ring[tail % ringslots];
+    struct timespec deadline = startTime;
+    deadline.tv_sec += slot->time / 1000;
+    deadline.tv_nsec += (slot->time % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_nsec -= 1000000000;
+      deadline.tv_sec++;
+    }
+
+    sleepUntil(&deadline);
+    if (stopRequested) break;
+
+    recordJitter(nanosSince(&deadline));
+    writeBatch(slot->port, slot->time, slot->data, slot->len);
+    atomic_store_explicit(&ringTail, tail + 1, memory_order_release);
   }
-  return 0;
+  return NULL;
 }
 
-
-// Send "All Sound Off" message to MIDI out
-void allSoundOff(void)
+void printJitter(void)
 {
-  for (uint8_t i=0x00; i<=0x0F; i++)
+  if (!jitterCount) return;
+
+  fprintf(stderr, "jitter: %u writes, min %lld us, mean %lld us, max %lld us\n", jitterCount,
+    (long long)jitterMin, (long long)(jitterSum / jitterCount), (long long)jitterMax);
+  for (int i=0; i<jitterbuckets; i++)
   {
-    MidiOut(0xB0 | i);  // command: Channel Mode Message
-    MidiOut(0x78);      // data1:   All sounds Off : 0x78=120
-    MidiOut(0x00);      // data2:   "0"
-    MidiOut(0xB0 | i);  // command: Channel Mode Message
-    MidiOut(0x7B);      // data1:   All Notes  Off : 0x7B=123
-    MidiOut(0x00);      // data2:   "0"
+    if (!jitterHist[i]) continue;
+    if (i == 0) fprintf(stderr, "  <= 0 us: %u\n", jitterHist[i]);
+    else if (i == jitterbuckets-1) fprintf(stderr, "  >= %d us: %u\n", 1 << (i-1), jitterHist[i]);
+    else fprintf(stderr, "  %d-%d us: %u\n", 1 << (i-1), (1 << i) - 1, jitterHist[i]);
   }
 }
 
+void onInterrupt(int sig)
+{
+  (void)sig;
+  stopRequested = 1;
+}
 
-// Read MIDI file header Chunk
-uint8_t readHeaderChunk(void)
+void flushPort(uint8_t port)
 {
-  for (int i=0; i<4; i++) midiheader.chk[i] = SDgetc();
-  midiheader.length = read32();
+  uint32_t len = batchLen[port];
 
-  midiheader.format   = read16();
-  midiheader.ntracks  = read16();
-  midiheader.division = read16();
+  if (!len) return;
 
-  tempo = 500000; // Default tempo : 500000 microsec / beat
+  if (realtime)
+  {
+    for (uint32_t i=0; i<len; i+=slotsize)
+    {
+      ringPush(port, millis, batch[port] + i, len - i < slotsize ? len - i : slotsize);
+    }
+  }
+  else if (synthFile) synthBatch(port, millis, batch[port], len);
+  else writeBatch(port, millis, batch[port], len);
 
-  return midiheader.chk[0]=='M' && midiheader.chk[1]=='T' && midiheader.chk[2]=='h' && midiheader.chk[3]=='d' && midiheader.length == 6 ? NoError : badFileheader;
+  batchLen[port] = 0;
 }
 
+// every port's bytes for this time, each in its own write
+void flushMidi(void)
+{
+  for (uint8_t port=0; port<maxports; port++) flushPort(port);
+}
 
-// Read MIDI file track Chunk
-uint8_t readTrackChunk(void)
+void MidiOut(uint8_t x)
 {
-  for (int i=0; i<4; i++) miditrack.chk[i] = SDgetc();
-  miditrack.length  = read32();
-  return miditrack.chk[0]=='M' && miditrack.chk[1]=='T' && miditrack.chk[2]=='r' && miditrack.chk[3]=='k' ? NoError : badTrackheader;
+  if (batchLen[outPort] == batchsize) flushPort(outPort);
+  batch[outPort][batchLen[outPort]++] = x;
+  outBytes++;
 }
 
+void midiOutBlock(uint8_t* msg)
+{
+  uint8_t len = msg[0];
 
-// Read MIDI file track event
-uint8_t readTrackEvent(void)
+  if (batchLen[outPort] + len > batchsize) flushPort(outPort);
+  memcpy(batch[outPort] + batchLen[outPort], msg + 1, len);
+  batchLen[outPort] += len;
+  outBytes += len;
+}
+
+// FORMAT 2 PATTERNS
+// Every MTrk of a format 2 file is a pattern of its own, starting at the
+// default tempo.  The chunk offsets are indexed when the file is opened,
+// so the chain (-c, all patterns in order by default) goes from one to
+// the next with a seek.
+#define maxpatterns 256
+#define maxchain    1024
+uint32_t patternOffset[maxpatterns];
+uint16_t npatterns = 0;
+uint16_t chain[maxchain];
+uint16_t chainLen = 0;
+
+// Walk the chunk headers only, other chunk types are skipped
+uint8_t indexPatterns(void)
 {
-  uint8_t c;
-  uint32_t ms;
-  // Read time
-  midievent.wait = readVariableLength();
-  // Read track event
-  midievent.event = readTrackByte();
-  if (midievent.event == 0xFF)
+  uint8_t hdr[8];
+  long back = ftell(midiFile);
+  uint32_t offset = 8 + midiheader.length;
+
+  npatterns = 0;
+  while (npatterns < maxpatterns && npatterns < midiheader.ntracks)
   {
-    // Meta event
-    // read Meta event type
-    midievent.mtype = readTrackByte();
-
-    // read data length
-    midievent.nbdata = readVariableLength();
-    // read data
-    readNdata(0);
-    if (midievent.mtype == MF_Meta_Tempo) // tempo
-    {
-      tempo = midievent.data[0] * 65536 + midievent.data[1] * 256 + midievent.data[2];
-   }
+    if (fseek(midiFile, offset, SEEK_SET) || fread(hdr, 1, 8, midiFile) != 8) break;
+    if (!memcmp(hdr, "MTrk", 4)) patternOffset[npatterns++] = offset;
+    offset += 8 + ((uint32_t)hdr[4] << 24 | hdr[5] << 16 | hdr[6] << 8 | hdr[7]);
   }
-  else if (midievent.event == 0XF0 || midievent.event == 0xF7)
+  fseek(midiFile, back, SEEK_SET);
+  return npatterns ? NoError : badTrackheader;
+}
+
+// "1,2,2,3" or "@file" with the numbers on any number of lines
+uint8_t parseChain(char* arg)
+{
+  static char text[8192];
+  char* p;
+
+  if (arg[0] == '@')
   {
-    // SysEx event
-    midievent.nbdata = 0;
-    do
-    {
-      // read one byte
-      c = readTrackByte();
-      if (midievent.nbdata < maxdata) midievent.data[midievent.nbdata++] = c;
-    } while (c != 0xF7 && tpos < miditrack.length);
+    FILE* f = fopen(arg + 1, "r");
+    size_t n;
+    if (!f) return 0;
+    n = fread(text, 1, sizeof(text) - 1, f);
+    fclose(f);
+    text[n] = 0;
   }
-  else if (midievent.event & 0x80)
+  else
   {
-    // Midi event
-    runningEvent = midievent.event;
-    // calculate the number of data bytes
-    midievent.nbdata = ((midievent.event & 0xE0) == 0xC0 ? 1 : 2);
-    // Read data bytes
-    readNdata(0);
+    strncpy(text, arg, sizeof(text) - 1);
   }
-  else
+
+  for (p = strtok(text, ", \t\r\n"); p; p = strtok(NULL, ", \t\r\n"))
   {
-    // Running event
-    // transfer first byte from event to data
-    midievent.data[0] = midievent.event;
-    // recall last event value
-    midievent.event = runningEvent;
-    // calculate the number of data bytes
-    midievent.nbdata = ((runningEvent & 0xE0) == 0xC0 ? 1 : 2);
-    // Read data bytes (starting from the second one since the first byte is alread in data)
-    readNdata(1);
+    int n = atoi(p);
+    if (n < 1 || n > maxpatterns || chainLen == maxchain) return 0;
+    chain[chainLen++] = n;
   }
+  return chainLen != 0;
+}
 
-  // Calculate next time on which data shall be played
-  ms = (midievent.wait * tempo) / midiheader.division / 1000;
-  nextTime += ms;
+// Stop and report what it cost on a 31250 baud link, 320us a byte
+void reportStop(void)
+{
+  uint32_t before = outBytes;
+  stopNotes();
+  flushBucket();
+  fprintf(stderr, "stop: %u bytes, %u.%02u ms (full panic 96 bytes, 30.72 ms)\n",
+    outBytes - before, (outBytes - before) * 32 / 100, (outBytes - before) * 32 % 100);
+}
 
-  // Output to MIDI device
-  if (midievent.event != 0xFF)
-  {
-    while (nextTime > millis)
-    {
-      // delay until millis is >= nexttime
-     // usleep((nextTime-millis) * 1000);
-      millis = nextTime;
-    }
 
-    MidiOut(midievent.event);
+// Play the chain of patterns of a format 2 file
+uint8_t readPatterns(void)
+{
+  uint16_t i;
+  uint8_t err = indexPatterns();
+
+  if (!chainLen)
+  {
+    for (i=0; i<npatterns; i++) chain[chainLen++] = i + 1;
+  }
 
-    for (uint32_t i=0; i<midievent.nbdata && i<maxdata; i++)
+  for (i=0; i<chainLen && !err; i++)
+  {
+    if (chain[i] > npatterns)
     {
-      MidiOut(midievent.data[i]);
+      fprintf(stderr, "no pattern %u, the file has %u.\n", chain[i], npatterns);
+      return badTrackheader;
     }
+    curTrack = chain[i];
+    seekFile(patternOffset[curTrack-1]);
+    err = readTrackChunk();
+
+    // nothing carries over from the pattern before
+    setTempo(500000);
+    runningEvent = 0;
+    if (!err) err = playTrack();
   }
-  return NoError;
+  return err;
 }
 
 
 // Read MIDI file (main part)
-void readMidi(void)
+uint8_t readMidi(void)
 {
-  uint16_t i;
   uint8_t err;
 
-  // Setup MIDI device
-  MIDIinit();
+  resetSong();
 
   // Read File header Chunk
   err = readHeaderChunk();
+  if (!err && midiheader.format == MF_Sequential_tracks) return readPatterns();
 
   // Read succesive Tracks
-  for (i=1; i<=midiheader.ntracks && !err; i++)
-  {
-    // Read track header Chunk
-    err = readTrackChunk();
+  if (!err && midiheader.ntracks) err = readTrackChunk();
+  if (!err) err = playTracks();
+  return err;
+}
 
-    // Read succesive Events
-    for (tpos=0; tpos < miditrack.length && !err;) 
-		{
-			err = readTrackEvent();
-		}
-  }
+
+// A whole number from lo to hi
+int numberOption(const char* arg, int lo, int hi, int* n)
+{
+  char* end;
+  long v = strtol(arg, &end, 10);
+
+  if (end == arg || *end || v < lo || v > hi) return 0;
+  *n = v;
+  return 1;
 }
 
+int usage(void)
+{
+  puts("usage: pcplay [-t] [-q ms] [-r] [-s us] [-x ms] [-p] [-S %] [-T semitones] [-m from:to] [-v ch:%] [-l passes] [-c chain] [-o output] [-P port:output] [-w file.wav] [--stats[=json]] file.mid");
+  puts("  -t  timestamped records");
+  puts("  -q  send in buckets of ms, 20 for ZX81 frames");
+  puts("  -r  play in real time");
+  puts("  -s  spin through the last us microseconds before each deadline");
+  puts("  -x  stop at ms as if interrupted");
+  puts("  -p  full panic after the note offs when stopped");
+  puts("  -S  speed in percent, 200 plays twice as fast");
+  puts("  -T  transpose, drums on channel 10 are left alone");
+  puts("  -m  send channel from (1-16) on channel to");
+  puts("  -v  scale the velocities of channel ch (1-16, 0 for all)");
+  puts("  -l  go round loopStart/loopEnd markers passes times, 255 forever");
+  puts("  -c  format 2: play the patterns in this order, 1,2,2,3 or @file");
+  puts("  -o  file, FIFO or pty to write to instead of stdout");
+  puts("  -P  output of MIDI Port port (0-15), the others play on -o");
+  puts("  -w  render to a WAV file with the built in synth instead");
+  puts("  --stats  parser and output counters on stderr, =json for one JSON line");
+  return 1;
+}
 
 int main(int argc, char** argv)
 {
-  midiFile = fopen(argv[1], "rb");
-  if (!midiFile) {
-    puts("can't open input file.");
-    return 1;
+  int opt, n;
+  uint8_t err;
+  pthread_t output;
+
+  static const struct option longOptions[] = {
+    { "stats", optional_argument, NULL, 256 },
+    { NULL, 0, NULL, 0 }
+  };
+
+  while ((opt = getopt_long(argc, argv, "tq:rs:x:pS:T:m:v:l:c:o:P:w:", longOptions, NULL)) != -1)
+  {
+    switch (opt)
+    {
+      case 256: if (!statOption(optarg)) return usage(); break;
+      case 't': timestamped = 1; break;
+      case 'q': if (!numberOption(optarg, 0, 65535, &n)) return usage(); frameMS = n; break;
+      case 'r': realtime = 1; break;
+      case 's': spinUS = atoi(optarg); break;
+      case 'x': stopAt = atoi(optarg); break;
+      case 'p': stopPanic = 1; break;
+      case 'l': loopPasses = atoi(optarg); break;
+      case 'c': if (!parseChain(optarg)) return usage(); break;
+      case 'S': if (!numberOption(optarg, 0, 65535, &n)) return usage(); speedPercent = n; break;
+      case 'T': if (!numberOption(optarg, -127, 127, &n)) return usage(); transpose = n; break;
+      case 'm': {
+        int from, to;
+        if (sscanf(optarg, "%d:%d", &from, &to) != 2 || from < 1 || from > 16 || to < 1 || to > 16) return usage();
+        chanRemap[from-1] = to-1;
+        break;
+      }
+      case 'v': {
+        int ch, percent;
+        if (sscanf(optarg, "%d:%d", &ch, &percent) != 2 || ch < 0 || ch > 16 || percent < 0 || percent > 255) return usage();
+        for (int i=0; i<16; i++) if (!ch || i == ch-1) velPercent[i] = percent;
+        break;
+      }
+      case 'o': {
+        portFd[0] = open(optarg, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (portFd[0] < 0) {
+          puts("can't open output file.");
+          return 1;
+        }
+        break;
+      }
+      case 'w': {
+        if (!synthOpen(optarg)) {
+          puts("can't open output file.");
+          return 1;
+        }
+        break;
+      }
+      case 'P': {
+        int port, at = 0;
+        if (sscanf(optarg, "%d:%n", &port, &at) != 1 || !at || port < 0 || port >= maxports) return usage();
+        portFd[port] = open(optarg + at, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (portFd[port] < 0) {
+          puts("can't open output file.");
+          return 1;
+        }
+        break;
+      }
+      default: return usage();
+    }
   }
+  if (optind >= argc || (realtime && synthFile)) return usage();
+  buildTransforms();
+
+  if (openFile(argv[optind])) return 1;
 
-  readMidi();
-  allSoundOff();
+  if (realtime)
+  {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onInterrupt;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+    if (pthread_create(&output, NULL, outputThread, NULL)) {
+      puts("can't start output thread.");
+      return 1;
+    }
+  }
 
+  statBegin(0, "play");
+  err = readMidi();
+  statEnd(0);
+  sendBucket();
+  if (err == userStop && !stopRequested)
+  {
+    // -x: the stop goes out at the stop time like any other batch
+    millis = stopAt;
+    reportStop();
+  }
+  else if (!stopRequested && !synthFile)
+  {
+    // a rendered song rings out instead
+    allSoundOff();
+    flushBucket();
+  }
+
+  if (realtime)
+  {
+    atomic_store(&parserDone, 1);
+    pthread_join(output, NULL);
+
+    // interrupted: silence the synth now rather than at the song's end
+    if (stopRequested)
+    {
+      realtime = 0;
+      memset(batchLen, 0, sizeof(batchLen));
+      bucketBytes = 0;
+      reportStop();
+    }
+    printJitter();
+  }
+
+  if (synthFile) synthClose();
+
+  midiStats.bytesIn = sdRead;
+  midiStats.refills = sdRefills;
+  midiStats.bytesOut = outBytes;
+  statPrint(stderr);
+  if (err && err != userStop)
+  {
+    fprintf(stderr, "error %d reading input file.\n", err);
+    return parseExit + err;
+  }
   return 0;
 }
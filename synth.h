@@ -0,0 +1,566 @@
+// Offline software synth for pcplay -w: renders the MIDI bytes pcplay
+// would send to a 16 bit stereo WAV file, much faster than real time
+//
+// Each batch first renders the audio up to its time, then its messages
+// change the voices.  A voice is a band-limited wavetable (one table per
+// octave, nothing above Nyquist) with a linear ADSR, both picked by the
+// program's family, and drums are noise or a sine thump.  Voices are
+// rendered a block at a time and mixed four samples at a time with gcc
+// vector extensions (SSE on x86, NEON on ARM).  Include once, after
+// <stdio.h>, <stdint.h>, <string.h> and <stdlib.h>; link with -lm.
+
+#ifndef SYNTH_H
+#define SYNTH_H
+
+#include <math.h>
+#include <time.h>
+
+#define synthrate    44100
+#define synthblock   64
+#define maxvoices    256
+#define synthports   16
+#define wavebits     11
+#define wavesize     (1 << wavebits)
+#define waveoctaves  11
+#define maxharmonics 256
+#define synthtail    5          // seconds rendered at most after the end
+
+typedef float v4f __attribute__((vector_size(16)));
+
+// WAVEFORMS
+enum SYNTHwaves
+{
+  waveSine     = 0,
+  waveTriangle = 1,
+  waveSaw      = 2,
+  waveSquare   = 3,
+  waveOrgan    = 4,
+  nwaves       = 5
+};
+
+float waveTable[nwaves][waveoctaves][wavesize];
+float sineTable[wavesize];
+
+// Sound of each GM family (program / 8): waveform and ADSR, the times in
+// seconds and the sustain level from 0 to 1
+typedef struct
+{
+  uint8_t wave;
+  float   attack, decay, sustain, release;
+} PATCH;
+
+const PATCH patches[16] =
+{
+  { waveTriangle, 0.002f, 1.50f, 0.00f, 0.30f },  // piano
+  { waveSine,     0.001f, 0.80f, 0.00f, 0.40f },  // chromatic percussion
+  { waveOrgan,    0.010f, 0.05f, 1.00f, 0.08f },  // organ
+  { waveSaw,      0.002f, 1.00f, 0.20f, 0.20f },  // guitar
+  { waveSaw,      0.005f, 0.60f, 0.50f, 0.10f },  // bass
+  { waveSaw,      0.100f, 0.20f, 0.80f, 0.30f },  // strings
+  { waveSaw,      0.150f, 0.20f, 0.80f, 0.40f },  // ensemble
+  { waveSquare,   0.040f, 0.20f, 0.70f, 0.15f },  // brass
+  { waveSquare,   0.030f, 0.10f, 0.80f, 0.10f },  // reed
+  { waveSine,     0.050f, 0.10f, 0.90f, 0.15f },  // pipe
+  { waveSaw,      0.005f, 0.10f, 0.80f, 0.10f },  // synth lead
+  { waveTriangle, 0.300f, 0.50f, 0.80f, 0.60f },  // synth pad
+  { waveTriangle, 0.050f, 0.50f, 0.50f, 0.50f },  // synth effects
+  { waveSaw,      0.005f, 0.80f, 0.10f, 0.20f },  // ethnic
+  { waveSine,     0.001f, 0.30f, 0.00f, 0.10f },  // percussive
+  { waveSaw,      0.050f, 0.50f, 0.50f, 0.50f }   // sound effects
+};
+
+// VOICES
+enum SYNTHstages
+{
+  stageFree    = 0,
+  stageAttack  = 1,
+  stageDecay   = 2,
+  stageSustain = 3,
+  stageRelease = 4
+};
+
+typedef struct
+{
+  uint8_t  stage;
+  uint8_t  held;          // key still down, or kept by the sustain pedal
+  uint8_t  channel;       // port * 16 + channel
+  uint8_t  key;
+  const float* table;     // NULL for noise
+  uint32_t phase, step;   // the table index is the top wavebits bits
+  uint32_t noise;
+  float    level;         // envelope
+  float    velGain;
+  float    attackRate, decayRate, sustain, releaseRate;  // per sample
+  uint32_t started;       // block number, the oldest is stolen first
+} VOICE;
+
+typedef struct
+{
+  uint8_t program;
+  uint8_t volume, expression, pan;
+  uint8_t sustain;
+  int16_t bend;           // -8192 .. 8191, 2 semitones each way
+  float   gainL, gainR;
+} SYNTHCHANNEL;
+
+// MIDI parser state of one port, running status carries over
+typedef struct
+{
+  uint8_t status;
+  uint8_t data[2];
+  uint8_t count;
+  uint8_t inSysex;
+} SYNTHPARSER;
+
+VOICE        voices[maxvoices];
+SYNTHCHANNEL synthChannels[synthports * 16];
+SYNTHPARSER  synthParsers[synthports];
+
+FILE*    synthFile = NULL;
+uint64_t synthSamples = 0;    // rendered so far
+uint32_t synthBlocks = 0;
+uint32_t synthPeakVoices = 0;
+struct timespec synthStart;
+
+float voiceBuf[synthblock] __attribute__((aligned(16)));
+v4f   mixL[synthblock / 4], mixR[synthblock / 4];
+int16_t pcmOut[synthblock * 2];
+
+// Sum the harmonics of one waveform up to the highest that stays under
+// Nyquist for the top note of the octave, bent up 2 semitones.  A
+// harmonic is a stride through the one sine table, no sin() per sample.
+void buildWave(uint8_t wave, uint8_t octave)
+{
+  float* t = waveTable[wave][octave];
+  double top = 440.0 * pow(2.0, (octave * 12 + 13 - 69) / 12.0);
+  uint32_t nh = (uint32_t)(synthrate / 2 / top);
+  float peak = 0;
+
+  if (nh > maxharmonics) nh = maxharmonics;
+  if (nh < 1) nh = 1;
+  memset(t, 0, sizeof(float) * wavesize);
+
+  for (uint32_t h=1; h<=nh; h++)
+  {
+    float a;
+    switch (wave)
+    {
+      case waveTriangle: a = h & 1 ? ((h >> 1) & 1 ? -1.0f : 1.0f) / (h * h) : 0; break;
+      case waveSaw:      a = 1.0f / h; break;
+      case waveSquare:   a = h & 1 ? 1.0f / h : 0; break;
+      case waveOrgan:    a = h == 1 || h == 2 || h == 3 || h == 4 || h == 6 || h == 8 ? 1.0f / h : 0; break;
+      default:           a = h == 1; break;
+    }
+    if (a == 0) continue;
+    for (uint32_t i=0; i<wavesize; i++) t[i] += a * sineTable[(h * i) & (wavesize - 1)];
+  }
+
+  for (uint32_t i=0; i<wavesize; i++) if (fabsf(t[i]) > peak) peak = fabsf(t[i]);
+  for (uint32_t i=0; i<wavesize; i++) t[i] /= peak;
+}
+
+void synthPan(SYNTHCHANNEL* c)
+{
+  float gain = (c->volume / 127.0f) * (c->expression / 127.0f);
+  float angle = (c->pan / 127.0f) * 1.5707963f;
+  c->gainL = gain * cosf(angle);
+  c->gainR = gain * sinf(angle);
+}
+
+void synthResetChannel(SYNTHCHANNEL* c)
+{
+  c->program = 0;
+  c->volume = 100;
+  c->expression = 127;
+  c->pan = 64;
+  c->sustain = 0;
+  c->bend = 0;
+  synthPan(c);
+}
+
+uint32_t synthStep(uint8_t key, int16_t bend)
+{
+  double freq = 440.0 * pow(2.0, (key - 69 + bend / 4096.0) / 12.0);
+  return (uint32_t)(freq / synthrate * 4294967296.0);
+}
+
+// WAV header, the sizes are filled in by synthClose()
+void synthHeader(uint32_t dataBytes)
+{
+  uint8_t h[44];
+  uint32_t v[] = { 36 + dataBytes, 16, synthrate, synthrate * 4, dataBytes };
+
+  memcpy(h, "RIFF", 4);
+  memcpy(h + 8, "WAVEfmt ", 8);
+  memcpy(h + 36, "data", 4);
+  for (int i=0; i<4; i++)
+  {
+    h[4 + i]  = v[0] >> (8 * i);
+    h[16 + i] = v[1] >> (8 * i);
+    h[24 + i] = v[2] >> (8 * i);
+    h[28 + i] = v[3] >> (8 * i);
+    h[40 + i] = v[4] >> (8 * i);
+  }
+  h[20] = 1; h[21] = 0;   // PCM
+  h[22] = 2; h[23] = 0;   // stereo
+  h[32] = 4; h[33] = 0;   // bytes per frame
+  h[34] = 16; h[35] = 0;  // bits per sample
+  fseek(synthFile, 0, SEEK_SET);
+  fwrite(h, 1, sizeof(h), synthFile);
+}
+
+uint8_t synthOpen(const char* name)
+{
+  synthFile = fopen(name, "wb");
+  if (!synthFile) return 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &synthStart);
+  for (uint32_t i=0; i<wavesize; i++) sineTable[i] = sinf(i * 6.2831853f / wavesize);
+  for (uint8_t w=0; w<nwaves; w++)
+  {
+    for (uint8_t o=0; o<waveoctaves; o++) buildWave(w, o);
+  }
+  for (int i=0; i<synthports*16; i++) synthResetChannel(&synthChannels[i]);
+  synthHeader(0);
+  return 1;
+}
+
+// NOTES
+void synthNoteOff(uint8_t channel, uint8_t key)
+{
+  for (int i=0; i<maxvoices; i++)
+  {
+    VOICE* v = &voices[i];
+    if (v->stage == stageFree || v->channel != channel || v->key != key || v->held != 1) continue;
+    if ((channel & 15) == 9) continue;    // drums ring out
+    if (synthChannels[channel].sustain) v->held = 2;
+    else
+    {
+      v->held = 0;
+      v->stage = stageRelease;
+    }
+  }
+}
+
+// a free voice, or the quietest releasing one, or the oldest
+VOICE* synthVoice(void)
+{
+  VOICE* best = NULL;
+
+  for (int i=0; i<maxvoices; i++)
+  {
+    VOICE* v = &voices[i];
+    if (v->stage == stageFree) return v;
+    if (!best) best = v;
+    else if (v->stage == stageRelease && (best->stage != stageRelease || v->level < best->level)) best = v;
+    else if (best->stage != stageRelease && v->started < best->started) best = v;
+  }
+  return best;
+}
+
+void synthNoteOn(uint8_t channel, uint8_t key, uint8_t velocity)
+{
+  SYNTHCHANNEL* c = &synthChannels[channel];
+  VOICE* v = synthVoice();
+  const PATCH* p = &patches[c->program >> 3];
+  float attack = p->attack, decay = p->decay, sustain = p->sustain, release = p->release;
+
+  v->table = waveTable[p->wave][key / 12];
+  v->step = synthStep(key, c->bend);
+
+  if ((channel & 15) == 9)
+  {
+    // drums: a thump for the bass drums, noise for the rest
+    v->table = NULL;
+    attack = 0.001f;
+    sustain = 0;
+    release = 0.05f;
+    switch (key)
+    {
+      case 35: case 36:          v->table = waveTable[waveSine][0]; v->step = synthStep(33, 0); decay = 0.25f; break;
+      case 42: case 44:          decay = 0.05f; break;
+      case 46:                   decay = 0.30f; break;
+      case 49: case 52: case 55: case 57: decay = 0.90f; break;
+      default:                   decay = 0.15f; break;
+    }
+  }
+
+  v->stage = stageAttack;
+  v->held = 1;
+  v->channel = channel;
+  v->key = key;
+  v->phase = 0;
+  v->noise = 0x12345678u ^ (key << 8) ^ channel;
+  v->level = 0;
+  v->velGain = (velocity / 127.0f) * (velocity / 127.0f) * 0.3f;
+  v->attackRate = 1.0f / (attack * synthrate);
+  v->decayRate = (1.0f - sustain) / (decay * synthrate);
+  v->sustain = sustain;
+  v->releaseRate = 1.0f / (release * synthrate);
+  v->started = synthBlocks;
+}
+
+// Let go of the voices only the sustain pedal was keeping
+void synthReleaseSustained(uint8_t channel)
+{
+  for (int i=0; i<maxvoices; i++)
+  {
+    VOICE* v = &voices[i];
+    if (v->stage != stageFree && v->channel == channel && v->held == 2)
+    {
+      v->held = 0;
+      v->stage = stageRelease;
+    }
+  }
+}
+
+void synthController(uint8_t channel, uint8_t number, uint8_t value)
+{
+  SYNTHCHANNEL* c = &synthChannels[channel];
+
+  switch (number)
+  {
+    case 7:  c->volume = value; synthPan(c); break;
+    case 10: c->pan = value; synthPan(c); break;
+    case 11: c->expression = value; synthPan(c); break;
+    case 64:
+      c->sustain = value >= 64;
+      if (!c->sustain) synthReleaseSustained(channel);
+      break;
+    case 120:   // all sound off
+    case 123:   // all notes off
+      for (int i=0; i<maxvoices; i++)
+      {
+        VOICE* v = &voices[i];
+        if (v->stage == stageFree || v->channel != channel) continue;
+        if (number == 120) v->stage = stageFree;
+        else if (v->held)
+        {
+          v->held = 0;
+          v->stage = stageRelease;
+        }
+      }
+      break;
+    case 121:   // reset all controllers
+      c->expression = 127;
+      c->sustain = 0;
+      c->bend = 0;
+      synthPan(c);
+      synthReleaseSustained(channel);
+      break;
+  }
+}
+
+void synthBend(uint8_t channel, int16_t bend)
+{
+  synthChannels[channel].bend = bend;
+  for (int i=0; i<maxvoices; i++)
+  {
+    VOICE* v = &voices[i];
+    if (v->stage != stageFree && v->channel == channel && (channel & 15) != 9) v->step = synthStep(v->key, bend);
+  }
+}
+
+void synthMessage(uint8_t port, uint8_t status, uint8_t* data)
+{
+  uint8_t channel = port * 16 + (status & 0x0F);
+
+  switch (status & 0xF0)
+  {
+    case 0x80: synthNoteOff(channel, data[0]); break;
+    case 0x90:
+      if (data[1]) synthNoteOn(channel, data[0], data[1]);
+      else synthNoteOff(channel, data[0]);
+      break;
+    case 0xB0: synthController(channel, data[0], data[1]); break;
+    case 0xC0: synthChannels[channel].program = data[0]; break;
+    case 0xE0: synthBend(channel, (data[0] | data[1] << 7) - 8192); break;
+  }
+}
+
+// RENDERING
+// The envelope of a block is a straight line from its level at the
+// start to the one at the end, stages change on block boundaries.
+float voiceEnvelope(VOICE* v, uint32_t n)
+{
+  float level = v->level;
+
+  switch (v->stage)
+  {
+    case stageAttack:
+      level += v->attackRate * n;
+      if (level >= 1.0f)
+      {
+        level = 1.0f;
+        v->stage = stageDecay;
+      }
+      break;
+    case stageDecay:
+      level -= v->decayRate * n;
+      if (level <= v->sustain)
+      {
+        level = v->sustain;
+        v->stage = v->sustain > 0 ? stageSustain : stageRelease;
+      }
+      break;
+    case stageRelease:
+      level -= v->releaseRate * n;
+      if (level < 0) level = 0;
+      break;
+  }
+  return level;
+}
+
+// One voice's samples for the block in voiceBuf, interpolated from its table
+void voiceSamples(VOICE* v, uint32_t n)
+{
+  uint32_t i;
+
+  if (!v->table)
+  {
+    for (i=0; i<n; i++)
+    {
+      v->noise = v->noise * 1664525u + 1013904223u;
+      voiceBuf[i] = (int32_t)v->noise * (1.0f / 2147483648.0f);
+    }
+  }
+  else
+  {
+    const float* t = v->table;
+    uint32_t phase = v->phase, step = v->step;
+    for (i=0; i<n; i++)
+    {
+      uint32_t idx = phase >> (32 - wavebits);
+      float frac = (phase & ((1u << (32 - wavebits)) - 1)) * (1.0f / (1u << (32 - wavebits)));
+      float a = t[idx];
+      voiceBuf[i] = a + (t[(idx + 1) & (wavesize - 1)] - a) * frac;
+      phase += step;
+    }
+    v->phase = phase;
+  }
+  for (; i<synthblock && (i & 3); i++) voiceBuf[i] = 0;
+}
+
+void renderBlock(uint32_t n)
+{
+  const v4f ramp = { 0, 1, 2, 3 };
+  uint32_t quads = (n + 3) / 4, active = 0;
+
+  memset(mixL, 0, sizeof(mixL));
+  memset(mixR, 0, sizeof(mixR));
+
+  for (int i=0; i<maxvoices; i++)
+  {
+    VOICE* v = &voices[i];
+    SYNTHCHANNEL* c;
+    float from, to, step;
+    v4f gain, gainStep, left, right;
+
+    if (v->stage == stageFree) continue;
+    active++;
+    c = &synthChannels[v->channel];
+    from = v->level * v->velGain;
+    to = voiceEnvelope(v, n);
+    v->level = to;
+    to *= v->velGain;
+    step = (to - from) / n;
+
+    voiceSamples(v, n);
+
+    // gain ramp four samples at a time, the pan folded in
+    gain = from + ramp * step;
+    gainStep = (v4f){ 4, 4, 4, 4 } * step;
+    left = (v4f){ 1, 1, 1, 1 } * c->gainL;
+    right = (v4f){ 1, 1, 1, 1 } * c->gainR;
+    for (uint32_t q=0; q<quads; q++)
+    {
+      v4f s = *(v4f*)&voiceBuf[q * 4] * gain;
+      mixL[q] += s * left;
+      mixR[q] += s * right;
+      gain += gainStep;
+    }
+
+    if (v->stage == stageRelease && v->level <= 0) v->stage = stageFree;
+  }
+  if (active > synthPeakVoices) synthPeakVoices = active;
+
+  for (uint32_t q=0; q<quads; q++)
+  {
+    v4f l = mixL[q] * 32767.0f, r = mixR[q] * 32767.0f;
+    for (int k=0; k<4; k++)
+    {
+      pcmOut[q * 8 + k * 2]     = l[k] < -32767.0f ? -32767 : l[k] > 32767.0f ? 32767 : (int16_t)l[k];
+      pcmOut[q * 8 + k * 2 + 1] = r[k] < -32767.0f ? -32767 : r[k] > 32767.0f ? 32767 : (int16_t)r[k];
+    }
+  }
+  fwrite(pcmOut, 4, n, synthFile);
+  synthSamples += n;
+  synthBlocks++;
+}
+
+// Audio up to ms into the song
+void synthRender(uint32_t ms)
+{
+  uint64_t due = (uint64_t)ms * synthrate / 1000;
+
+  while (synthSamples < due)
+  {
+    renderBlock(due - synthSamples < synthblock ? due - synthSamples : synthblock);
+  }
+}
+
+// A batch of bytes due at ms on a port: audio up to then, then its messages
+void synthBatch(uint8_t port, uint32_t ms, uint8_t* data, uint32_t len)
+{
+  SYNTHPARSER* p = &synthParsers[port];
+
+  synthRender(ms);
+  for (uint32_t i=0; i<len; i++)
+  {
+    uint8_t x = data[i];
+
+    if (x & 0x80)
+    {
+      if (x >= 0xF8) continue;     // real time messages don't cancel anything
+      p->inSysex = x == 0xF0;
+      p->status = x < 0xF0 ? x : 0;
+      p->count = 0;
+      continue;
+    }
+    if (p->inSysex || !p->status) continue;
+
+    p->data[p->count++] = x;
+    if (p->count == ((p->status & 0xE0) == 0xC0 ? 1 : 2))
+    {
+      synthMessage(port, p->status, p->data);
+      p->count = 0;
+    }
+  }
+}
+
+// Let the last notes ring out, fill in the header and report the speed
+void synthClose(void)
+{
+  struct timespec now;
+  uint64_t end = synthSamples + (uint64_t)synthtail * synthrate;
+  double took, seconds;
+
+  for (;;)
+  {
+    uint8_t sounding = 0;
+    for (int i=0; i<maxvoices && !sounding; i++) sounding = voices[i].stage != stageFree;
+    if (!sounding || synthSamples >= end) break;
+    renderBlock(synthblock);
+  }
+
+  synthHeader(synthSamples * 4);
+  fclose(synthFile);
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  took = (now.tv_sec - synthStart.tv_sec) + (now.tv_nsec - synthStart.tv_nsec) / 1e9;
+  seconds = (double)synthSamples / synthrate;
+  fprintf(stderr, "render: %.3f s of audio in %.3f s, %.1fx real time, %u voices at most\n",
+    seconds, took, took > 0 ? seconds / took : 0, synthPeakVoices);
+}
+
+#endif
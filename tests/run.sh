@@ -0,0 +1,253 @@
+#!/bin/sh
+# Golden output and throughput check for the host tools
+#
+#   tests/run.sh            compare against tests/golden.sums
+#   tests/run.sh --update   rewrite it from the current tree
+#
+# Every host-buildable program is run over the bundled songs and
+# tests/corpus, and the SHA-256 of its output byte stream (with pcplay's
+# -t timestamps) compared with the stored one.  KEEP=dir keeps the
+# outputs to look at what changed.  The throughput check takes the parse
+# times from --stats=json.  Times from another machine mean nothing here,
+# so the baseline is a git revision, tests/perf.base or PERF_BASE=rev
+# (one with --stats): its pcplay and midinfo are built and run on this
+# host too, and the check fails when this tree is more than PERF_SLACK
+# percent (default 30) slower.  PERF_BASE=none only reports the times.
+# BIN is where the programs are, they are built there with $CC when it
+# is not given.
+
+cd "$(dirname "$0")/.." || exit 1
+
+update=0
+[ "$1" = "--update" ] && update=1
+
+CC=${CC:-gcc}
+PERF_SLACK=${PERF_SLACK:-30}
+PERF_RUNS=${PERF_RUNS:-20}
+PERF_BASE=${PERF_BASE:-$(cat tests/perf.base)}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+if [ -z "$BIN" ]; then
+  BIN=$TMP/bin
+  mkdir -p "$BIN"
+  $CC -O2 -pthread -o "$BIN/pcplay" pcplay.c -lm &&
+  $CC -O2 -o "$BIN/midiplay" midiplay.c &&
+  $CC -O2 -o "$BIN/midinfo" midinfo.c &&
+  $CC -O2 -o "$BIN/midimin" midimin.c &&
+  $CC -O2 -o "$BIN/midipack" midipack.c &&
+  $CC -O2 -pthread -o "$BIN/midibatch" midibatch.c &&
+  $CC -O2 -o "$BIN/midicheck" midicheck.c || exit 1
+fi
+
+failed=0
+[ -n "$KEEP" ] && mkdir -p "$KEEP"
+
+# check name: add the sum of $TMP/out to the list
+check()
+{
+  echo "$(sha256sum < "$TMP/out" | cut -d' ' -f1) $1" >> "$TMP/sums"
+  [ -n "$KEEP" ] && cp "$TMP/out" "$KEEP/$1"
+}
+
+for song in *.mid tests/corpus/*.mid; do
+  name=$(basename "$song" .mid)
+
+  "$BIN/pcplay" -t "$song" > "$TMP/out" 2>&1;             check "pcplay-$name"
+  "$BIN/pcplay" -t -q 20 "$song" > "$TMP/out" 2>&1;       check "pcplay-q20-$name"
+  "$BIN/pcplay" -t -l 2 "$song" > "$TMP/out" 2>&1;        check "pcplay-l2-$name"
+  "$BIN/pcplay" -t -x 1000 "$song" > "$TMP/out" 2>&1;     check "pcplay-x1000-$name"
+  "$BIN/midiplay" "$song" > "$TMP/out" 2>&1;              check "midiplay-$name"
+  "$BIN/midinfo" "$song" > "$TMP/out" 2>&1;               check "midinfo-$name"
+  "$BIN/midinfo" -j -e "$song" > "$TMP/out" 2>&1;         check "midinfo-json-$name"
+  "$BIN/midinfo" -b -e "$song" > "$TMP/out" 2>&1;         check "midinfo-bin-$name"
+
+  # converters: their report, exit status and the file written
+  rm -f "$TMP/file"
+  { "$BIN/midimin" "$song" "$TMP/file"; echo "exit $?"; cat "$TMP/file" 2>/dev/null; } > "$TMP/out" 2>&1
+  check "midimin-$name"
+  rm -f "$TMP/file"
+  { "$BIN/midipack" -f "$song" "$TMP/file"; echo "exit $?"; cat "$TMP/file" 2>/dev/null; } > "$TMP/out" 2>&1
+  check "midipack-$name"
+done
+
+# midimin drops the text meta but keeps the lyric and the marker
+printf 'MThd\0\0\0\6\0\0\0\1\0\140MTrk\0\0\0\42\0\377\1\4text\0\377\5\2la\0\377\6\4mark\0\220\74\100\140\200\74\0\0\377\57\0' > "$TMP/lyric.mid"
+rm -f "$TMP/file"
+{ "$BIN/midimin" "$TMP/lyric.mid" "$TMP/file"; echo "exit $?"; cat "$TMP/file" 2>/dev/null; } > "$TMP/out" 2>&1
+check "midimin-lyric"
+
+# a 20000 tick rest at quarter speed, 416666 ms: far past where
+# wait * tempo overflows 32 bits
+printf 'MThd\0\0\0\6\0\0\0\1\0\140MTrk\0\0\0\16\0\220\74\100\201\234\40\200\74\0\0\377\57\0' > "$TMP/rest.mid"
+"$BIN/pcplay" -t -S 25 "$TMP/rest.mid" > "$TMP/out" 2>&1;  check "pcplay-slow-rest"
+
+# a loop that changes volume and program and holds a note and the
+# pedal at its end: released, then the loop start's state sent again
+printf 'MThd\0\0\0\6\0\0\0\1\0\140MTrk\0\0\0\66\0\300\5\0\260\7\144\0\377\6\11loopStart\0\220\74\100\140\260\7\40\0\300\12\0\260\100\177\60\377\6\7loopEnd\0\200\74\0\0\377\57\0' > "$TMP/loopstate.mid"
+"$BIN/pcplay" -t -l 1 "$TMP/loopstate.mid" > "$TMP/out" 2>&1;  check "pcplay-loop-state"
+
+# format 2: patterns in the order of a chain, each at its own tempo
+"$BIN/pcplay" -t -c 3,1,3 tests/corpus/format2.mid > "$TMP/out" 2>&1;  check "pcplay-chain-format2"
+
+# MIDI Port metas: ports 1 and 2 to files of their own, the rest on stdout
+{ "$BIN/pcplay" -t -P 1:"$TMP/port1" -P 2:"$TMP/port2" -x 2250 tests/corpus/ports.mid; cat "$TMP/port1" "$TMP/port2"; } > "$TMP/out" 2>&1
+check "pcplay-split-ports"
+
+# the synth: the samples hang on libm and the compiler's float code, so the
+# WAV is checked for its header, a length from the song's to 5 s of tail
+# past it, and a peak that is neither near silence nor clipped
+wavcheck()
+{
+  size=$(wc -c < "$1")
+  header=$(od -An -v -t u4 -N 44 "$1" | tr -s ' \n' '  ')
+  fmt=$(od -An -v -t u2 -j 20 -N 4 "$1" | tr -s ' \n' '  ')
+  bits=$(od -An -v -t u2 -j 32 -N 4 "$1" | tr -s ' \n' '  ')
+  tags=$(od -An -v -c -N 40 "$1" | tr -d ' \n')
+  data=$((size - 44))
+  frames=$((data / 4))
+  peak=$(od -An -v -t d2 -j 44 "$1" | awk '{ for (i=1; i<=NF; i++) { v = $i < 0 ? -$i : $i; if (v > p) p = v } } END { print p+0 }')
+  songMS=$("$BIN/midinfo" "$2" | sed -n 's/^POLYPHONY (\([0-9]*\) ms)/\1/p')
+
+  case "$tags" in RIFF*WAVEfmt*data) echo "tags ok" ;; *) echo "tags $tags" ;; esac
+  set -- $header
+  [ "$2" = $((size - 8)) ] && [ "$5" = 16 ] && [ "$7" = 44100 ] && [ "$8" = 176400 ] && [ "${11}" = $data ] &&
+    echo "sizes ok" || echo "sizes $header, file $size"
+  [ "$fmt" = " 1 2 " ] && [ "$bits" = " 4 16 " ] && echo "pcm 16 bit stereo" || echo "format $fmt $bits"
+  [ $((frames * 1000)) -ge $((songMS * 44100)) ] && [ $((frames * 1000)) -le $(((songMS + 5100) * 44100)) ] &&
+    echo "length ok" || echo "length $frames frames, song $songMS ms"
+  [ "$peak" -gt 1000 ] && [ "$peak" -lt 32767 ] && echo "peak ok" || echo "peak $peak"
+}
+"$BIN/pcplay" -w "$TMP/wav" tests/corpus/format1.mid 2>/dev/null
+wavcheck "$TMP/wav" tests/corpus/format1.mid > "$TMP/out" 2>&1;  check "pcplay-wav-format1"
+
+# batch: every target over the corpus and two broken files, then a resume
+# that only retries the failures.  The timing line is left out of the log,
+# and the files written are summed on their own, binary as they are.
+mkdir -p "$TMP/batch"
+printf 'RIFF\0\0\0\6\0\1\0\1\0\140' > "$TMP/batch/badheader.mid"
+printf 'MThd\0\0\0\6\0\1\0\1\0\140MTrx\0\0\0\0' > "$TMP/batch/badtrack.mid"
+for song in tests/corpus/*.mid "$TMP"/batch/*.mid; do
+  for target in stream wav min pack json bin; do
+    echo "$target $song $TMP/batch/$(basename "$song").$target"
+  done
+done > "$TMP/jobs"
+{
+  "$BIN/midibatch" -j 2 -d "$BIN" "$TMP/jobs"; echo "exit $?"
+  "$BIN/midibatch" -j 2 -d "$BIN" -r "$TMP/jobs"; echo "exit $?"
+} 2>&1 | grep -v files/s | sed "s#$TMP#TMP#g" > "$TMP/out"
+check "midibatch"
+for file in "$TMP"/batch/*.stream "$TMP"/batch/*.min "$TMP"/batch/*.pack "$TMP"/batch/*.json "$TMP"/batch/*.bin; do
+  echo "$(basename "$file") $(wc -c < "$file")"
+  cat "$file"
+done > "$TMP/out" 2>&1
+check "midibatch-files"
+
+# validator over the songs and broken files, and the players stopping on
+# the same files with the parser error as their exit status
+mkdir -p "$TMP/broken"
+head -c 3000 100.mid > "$TMP/broken/truncated.mid"
+cp "$TMP"/batch/*.mid "$TMP/broken/"
+printf 'MThd\0\0\0\6\0\0\0\1\0\140MTrk\0\0\0\6\0\377\1\177ab' > "$TMP/broken/badmeta.mid"
+printf 'MThd\0\0\0\6\0\0\0\1\0\140MTrk\0\0\0\4\0\100\100\0' > "$TMP/broken/norunning.mid"
+# a split SysEx, the players would read the note into it
+printf 'MThd\0\0\0\6\0\0\0\1\0\140MTrk\0\0\0\22\0\360\3\101\20\102\0\367\2\22\367\0\220\74\100\0\377\57\0' > "$TMP/broken/splitsysex.mid"
+{
+  "$BIN/midicheck" *.mid tests/corpus/*.mid "$TMP"/broken/*.mid; echo "exit $?"
+  for song in "$TMP"/broken/*.mid; do
+    "$BIN/pcplay" -t "$song" > /dev/null 2>&1; echo "pcplay $(basename "$song") exit $?"
+    "$BIN/midiplay" "$song" > /dev/null 2>&1; echo "midiplay $(basename "$song") exit $?"
+  done
+} 2>&1 | sed "s#$TMP#TMP#g" > "$TMP/out"
+check "midicheck"
+
+if [ $update = 1 ]; then
+  cp "$TMP/sums" tests/golden.sums
+else
+  # names whose sum changed, went or is new
+  sort tests/golden.sums > "$TMP/want"
+  sort "$TMP/sums" > "$TMP/got"
+  for name in $(comm -3 "$TMP/want" "$TMP/got" | awk '{ print $2 }' | sort -u); do
+    echo "FAIL $name"
+    failed=1
+  done
+fi
+
+# THROUGHPUT
+# Parse time in microseconds of the two large songs, the best of
+# PERF_RUNS: a run only ever gets slower from what else the host is doing,
+# so the fastest is the one to compare.  The tree and the baseline are
+# built alike and run in turns, so a busy spell slows them both.
+if [ $update = 1 ]; then
+  echo "updated tests/golden.sums"
+  exit 0
+fi
+
+# once phase program args: one run over both songs
+once()
+{
+  phase=$1
+  shift
+  total=0
+  for song in 100.mid type0.mid; do
+    us=$("$@" --stats=json "$song" 2>&1 >/dev/null | tail -1 | sed -n "s/.*\"$phase\":\([0-9]*\).*/\1/p")
+    total=$((total + us))
+  done
+  echo $total
+}
+
+# keepBest var us: the smaller of the two in var
+keepBest()
+{
+  eval "old=\$$1"
+  if [ -z "$old" ] || [ "$2" -lt "$old" ]; then eval "$1=$2"; fi
+}
+
+# build dir src: pcplay and midinfo from the sources in src
+build()
+{
+  mkdir -p "$1" &&
+  $CC -O2 -pthread -o "$1/pcplay" "$2/pcplay.c" -lm &&
+  $CC -O2 -o "$1/midinfo" "$2/midinfo.c"
+}
+
+pcplayNow=
+midinfoNow=
+pcplayBase=
+midinfoBase=
+build "$TMP/now" . || exit 1
+if [ "$PERF_BASE" != none ]; then
+  mkdir -p "$TMP/base"
+  if ! { git archive "$PERF_BASE" 2>/dev/null | tar -x -C "$TMP/base" && build "$TMP/basebin" "$TMP/base"; }; then
+    echo "FAIL can't build $PERF_BASE, PERF_BASE=none only reports the times"
+    exit 1
+  fi
+fi
+
+i=0
+while [ $i -lt "$PERF_RUNS" ]; do
+  keepBest pcplayNow "$(once play "$TMP/now/pcplay")"
+  keepBest midinfoNow "$(once report "$TMP/now/midinfo" -j -e)"
+  if [ "$PERF_BASE" != none ]; then
+    keepBest pcplayBase "$(once play "$TMP/basebin/pcplay")"
+    keepBest midinfoBase "$(once report "$TMP/basebin/midinfo" -j -e)"
+  fi
+  i=$((i + 1))
+done
+
+for tool in pcplay midinfo; do
+  eval now=\$"${tool}Now" base=\$"${tool}Base"
+  if [ "$PERF_BASE" = none ]; then
+    echo "$tool: $now us"
+    continue
+  fi
+  limit=$((base + base * PERF_SLACK / 100))
+  echo "$tool: $now us, $PERF_BASE $base us"
+  if [ "$now" -gt "$limit" ]; then
+    echo "FAIL $tool throughput, more than $PERF_SLACK% slower than $PERF_BASE"
+    failed=1
+  fi
+done
+
+[ $failed = 0 ] && echo "all passed"
+exit $failed
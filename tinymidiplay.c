@@ -1,521 +1,513 @@
 // based on https://community.atmel.com/projects/sd-card-midi-player
+//
+// tinymidiplay: the ZX81 player, midicore.h on backend_zx81.h (the SD
+// card through the ZXpand, the clock and the keys) with the settings,
+// the lyrics display and the playlist here.  pcplay and midiplay build
+// the same core for the host.
 
 #include <stdio.h>
 #include <unistd.h>
-
-// Controller
-#define MF_Bank_Select_MSB    0x00	// 0x00 .Bank Select MSB ( value 0x50 : Preset A Patch 1..128, 0x51 Preset B Patch 129..255 )
-#define MF_Bank_Select_LSB    0x20	// 0x20 .Bank Select LSB ( value 0x00 )
-#define MF_Modulation         0x01	// 0x01 .Modulation
-#define MF_Breath             0x02	// 0x02  Breath Controller
-#define MF_Foot               0x04	// 0x04  Foot Controller
-#define MF_Portamento_Time    0x05	// 0x05 .Portamento Time
-#define MF_Main_Volume        0x07	// 0x07 .Main Volume
-#define MF_Balance            0x08	// 0x08  Balance
-#define MF_Pan                0x0A	// 0x0A .Pan
-#define MF_Expression         0x0B	// 0x0B .Expression Controller
-#define MF_Effect_1           0x0C	// 0x0C  Effect Control 1
-#define MF_Effect_2           0x0D	// 0x0D  Effect Control 2
-#define MF_General_1to4       0x13	// 0x13  General-Purpose Controllers 1-4
-#define MF_Controller_LSB     0x3F	// 0x3F  LSB for controllers 0-31
-#define MF_Sustain            0x40	// 0x40 .Sustain( Damper pedal / Hold 1)
-#define MF_Portamento         0x41	// 0x41 .Portamento
-#define MF_Sostenuto          0x42	// 0x42 .Sostenuto
-#define MF_Soft               0x43	// 0x43 .Soft Pedal
-#define MF_Legato             0x44	// 0x44  Legato Footswitch
-#define MF_Hold               0x45	// 0x45  Hold 2
-#define MF_Control_1          0x46	// 0x46  Sound Controller 1 (default: Timber Variation)
-#define MF_Control_2          0x47	// 0x47  Sound Controller 2 (default: Timber/Harmonic Content)
-#define MF_Control_3          0x48	// 0x48  Sound Controller 3 (default: Release Time)
-#define MF_Control_4          0x49	// 0x49  Sound Controller 4 (default: Attack Time)
-#define MF_Portamento_Ctrl    0x54	// 0x54  Portamento Control
-#define MF_Reverb             0x5B	// 0x5B .Effects 1 Depth (M-GS64 : Reverb send level)
-#define MF_Effects_2          0x5C	// 0x5C  Effects 2 Depth (formerly Tremolo Depth)
-#define MF_Chorus             0x5D	// 0x5D .Effects 3 Depth (M-GS64 : Chorus send level)
-#define MF_Effects_4          0x5E	// 0x5E  Effects 4 Depth (formerly Celeste Detune)
-#define MF_Effects_5          0x5F	// 0x5F  Effects 5 Depth (formerly Phaser Depth)
-#define MF_Data_Increment     0x60	// 0x60  Data Increment
-#define MF_Data_Decrement     0x61	// 0x61  Data Decrement
-#define MF_NRPN_LSB           0x62	// 0x62 .Non-Registered Parameter Number (LSB)
-#define MF_NRPN_MSB           0x63	// 0x63 .Non-Registered Parameter Number (MSB)
-#define MF_RPN_LSB            0x64	// 0x64 .Registered Parameter Number (LSB)
-#define MF_RPN_MSB            0x65	// 0x65 .Registered Parameter Number (MSB)
-#define MF_Mode_Message       0x7F	// 0x7F  Mode Messages
-#define MF_Data_Entry_MSB     0x06	// 0x06  Data Entry (MSB)
-#define MF_Data_Entry_LSB     0x26	// 0x26  Data Entry (LSB)
-
-// MIDI File Formats
-#define MF_Single_track       0x00
-#define MF_Parallel_tracks    0x01
-#define MF_Sequential_tracks  0x02
-
-// Meta Events Type
-#define MF_Meta_Sequence         0x00  // Sequence number
-#define MF_Meta_Text             0x01  // Text event
-#define MF_Meta_Copyright        0x02  // Copyright
-#define MF_Meta_Track_name       0x03  // track name
-#define MF_Meta_Instrument_name  0x04  // Instrument name
-#define MF_Meta_Lyric            0x05  // Lyric text
-#define MF_Meta_Marker           0x06  // Marker text
-#define MF_Meta_Cue_point        0x07  // Cue point
-#define MF_Meta_MIDI_channel     0x20  // MIDI channel
-#define MF_Meta_MIDI_Port        0x21  // MIDI Port
-#define MF_Meta_Track_End        0x2F  // End of track
-#define MF_Meta_Tempo            0x51  // tempo setting
-#define MF_Meta_SMPTE_offset     0x54  // SMPTE offset
-#define MF_Meta_Time_signature   0x58  // Time signature
-#define MF_Meta_Key_signature    0x59  // Key signature
-#define MF_Meta_Special          0x7F  // Seq. special
-
-// FILE header INFORMATION
-typedef struct
-{
-  uint8_t  chk[4];
-  uint32_t length;
-  uint16_t format;
-  uint16_t ntracks;
-  uint16_t division;
-} MTHD;
-
-// TRACK INFORMATION
-typedef struct
+#include <stdint.h>
+#include <string.h>
+
+#include "backend_zx81.h"
+
+// The keys are read after each bucket and through every wait, lyrics
+// and markers go to the display, and only BREAK stops a song early
+uint8_t waitUntil(uint32_t due);
+uint8_t handleKeys(void);
+void    queueText(void);
+#define stopKeys() (keysDown() && handleKeys())
+#define timeUp() 0
+#define textEvent() queueText()
+
+#include "midicore.h"
+
+
+// SETTINGS
+// What follows the first comma of the LOAD parameter, or of a playlist
+// line, is a comma separated list of a letter and a number each:
+//   load "mp:song,s150,t-2"
+//   S150   speed in %, 50 plays at half speed, 200 at double
+//   T-2    transpose in semitones, drums on 10 are left alone
+//   V80    velocity in % on every channel, V10=120 on channel 10 only
+//   C3=10  channel 3 plays on channel 10
+//   F40    bucket length in ms, F0 sends every time change on its own
+//   X      the full panic after the note offs on a stop
+//   P1     play only what goes to MIDI port 1
+//   L2     go back to the loopStart marker twice, L255 for ever
+//   B      PROFILE build only: time the reads instead of playing
+// Each song of a playlist starts from the LOAD settings, then its line's.
+char     loadSettings[32];
+uint8_t  songSettings = 0;            // the last song had settings of its own
+#ifdef PROFILE
+uint8_t  benchSong = 0;               // B, see benchReads()
+#endif
+
+// DISPLAY
+// Lyric and marker events are queued as they are parsed, a bucket or so
+// ahead of the music, and only put on the screen while waiting for the
+// next bucket's time.  Each entry is the length (+128 for a marker), the
+// due time in ms and up to 32 characters, in a 256 byte ring at $a100.
+// A full queue drops text rather than hold up playback.
+#define markerLine 18
+#define lyricLine  20
+#define clockLine  22
+#define barLine    23
+uint8_t* textQueue = (uint8_t*)0xa100;
+uint8_t  textHead = 0;
+uint8_t  textTail = 0;
+uint8_t  lyricCol = 0;
+uint16_t seconds = 0;
+uint32_t nextSecond = 0;
+
+// The characters of the LOAD parameter the settings use, from the ZX81
+// set: digits, letters and + - = , space
+char zx_ascii(uint8_t c)
 {
-  uint8_t  chk[4];
-  uint32_t length;
-} MTRK;
+  c &= 0x7F;
+  if (c >= 38 && c < 64) return 'A' + c - 38;
+  if (c >= 28 && c < 38) return '0' + c - 28;
+  switch (c)
+  {
+    case 0:  return ' ';
+    case 20: return '=';
+    case 21: return '+';
+    case 22: return '-';
+    case 26: return ',';
+  }
+  return '?';
+}
 
-// EVENT INFORMATION
-#define maxdata 128
-typedef struct
-{
-  uint32_t wait;
-  uint8_t  event;
-  uint8_t  mtype; // only for Meta Events
-  uint32_t nbdata;
-  uint8_t  data[maxdata];
-} MTEV;
-
-// RETURN CODES
-enum MIDIerrors
+// Back to playing the song as written
+void defaultSettings(void)
 {
-  NoError        = 0,
-  badFileheader  = 1,
-  badTrackheader = 2,
-  badEvent       = 3,
-  endOfFile      = 4,
-	userStop       = 5
-};
-
-// FUNCTIONS
-void     clearBuffer(void);
-uint8_t  readByte(void);
-//uint8_t  readTrackByte(void);
-uint8_t  readHeaderChunk(void);
-uint8_t  readTrackChunk(void);
-uint16_t read16(void);
-uint32_t read32(void);
-uint32_t readVariableLength(void);
-uint8_t  readNdata(uint8_t start);
-uint8_t  readTrackEvent(void);
-void     allSoundOff(void);
-
-// Position in track
-uint32_t tpos     = 0;
-uint32_t prevpos  = 0;
-
-// LAST EVENT READ
-uint8_t runningEvent = 0;
-
-// TEMPO (microsec/beat)
-uint32_t tempo = 500000;
-
-// Shared variables
-MTHD midiheader;
-MTRK miditrack;
-MTEV midievent;
-
-uint32_t millis = 0;
-uint32_t nextTime = 0;
-
-uint8_t sdDatIdx = 255;
-uint8_t* sdData = (uint8_t*)0x8200;
-
-// length is tracked by midi reader so we don't need to do it here
-//
-uint8_t SDgetc(void) __naked
+  uint8_t i;
+
+  speedPercent = 100;
+  transpose = 0;
+  frameMS = frameHz == 60 ? 17 : 20;
+  stopPanic = 0;
+  playPort = 255;
+  loopPasses = 0;
+#ifdef PROFILE
+  benchSong = 0;
+#endif
+  for (i=0; i<16; i++) {
+    chanRemap[i] = i;
+    velPercent[i] = 100;
+  }
+}
+
+// A signed decimal number at *s, 0 when there are no digits
+int16_t parseNumber(char** s)
 {
-    #asm
-    ld    hl,$8200
-
-    ld    a,(_sdDatIdx)
-    inc   a
-    ld    (_sdDatIdx),a
-    jr    nz,getdata
-
-    ld    (16446),a   ; 256 bytes to load
-
-    ld    bc,$e007    ; flush any midi bytes out of the input buffer before we overwrite it
-    ld    a,$c0
-    out   (c),a
-    call  $1ff6 ; wait for it ...
-    ld    bc,$0007
-    ld    a,1
-    out   (c),a
-    call  $1ff6 ; wait for it ...
-
-    ld    a,14        ; 00001110  - read, wait and store
-    ld    (16444),a
-    ld    (16447),hl
-    call  $1ff4
-
-    xor   a
-
-getdata:
-    ld    h,$82
-    ld    l,a
-    ld    l,(hl)
-    ld    h,0
-    ret
-    #endasm
+  int16_t v = 0;
+  uint8_t minus = **s == '-';
+
+  if (minus || **s == '+') ++*s;
+  while (**s >= '0' && **s <= '9') v = v * 10 + *(*s)++ - '0';
+  return minus ? -v : v;
 }
 
+// Apply settings in ASCII, see SETTINGS; anything unknown is skipped
+void parseSettings(char* s)
+{
+  char c;
+  int16_t n, m;
 
-// 16444 = pr_buff
+  while (*s)
+  {
+    c = *s++ & 0xDF;    // upper case
+    n = parseNumber(&s);
+    m = -1;
+    if (*s == '=') {
+      ++s;
+      m = parseNumber(&s);
+    }
+    switch (c)
+    {
+      case 'S':
+        if (n > 0 && n < 256) speedPercent = n;
+        break;
+      case 'T':
+        if (n > -128 && n < 128) transpose = n;
+        break;
+      case 'V':
+        if (m < 0) {
+          if (n > 0 && n < 256) memset(velPercent, n, 16);
+        }
+        else if (n >= 1 && n <= 16 && m > 0 && m < 256) velPercent[n-1] = m;
+        break;
+      case 'C':
+        if (n >= 1 && n <= 16 && m >= 1 && m <= 16) chanRemap[n-1] = m-1;
+        break;
+      case 'F':
+        if (n >= 0 && n < 256) frameMS = n;
+        break;
+      case 'X':
+        stopPanic = 1;
+        break;
+      case 'P':
+        if (n >= 0 && n < 255) playPort = n;
+        break;
+      case 'L':
+        if (n >= 0 && n < 256) loopPasses = n;
+        break;
+#ifdef PROFILE
+      case 'B':
+        benchSong = 1;
+        break;
+#endif
+    }
+    while (*s && *s != ',') s++;
+    if (*s) s++;
+  }
+}
 
-void cvtcmd(unsigned char* buf)
+// Start of a display line, the display file is expanded with 32K
+uint8_t* screenLine(uint8_t n)
 {
-	while (*buf)
-	{
-		*buf = ascii_zx(*buf);
-		++buf;
-	}
-  --buf;
-  *buf = (*buf) + 128;
+  return *(uint8_t**)16396 + 1 + n * 33;
 }
 
-void terminate(unsigned char* name)
+// Queue the lyric or marker in midievent, due at nextTime
+void queueText(void)
 {
-  name[strlen(name)-1] = name[strlen(name)-1] + 128;
+  uint8_t len = midievent.nbdata < 32 ? midievent.nbdata : 32;
+  uint8_t i;
+
+  if ((uint8_t)(textTail - textHead - 1) < len + 5) return;
+
+  textQueue[textHead++] = midievent.mtype == MF_Meta_Marker ? len | 0x80 : len;
+  textQueue[textHead++] = nextTime;
+  textQueue[textHead++] = nextTime >> 8;
+  textQueue[textHead++] = nextTime >> 16;
+  textQueue[textHead++] = nextTime >> 24;
+  for (i=0; i<len; i++) textQueue[textHead++] = midievent.data[i];
 }
 
-unsigned char* zstrend(unsigned char* p)
+// Markers replace their line, lyrics run on along theirs and a / \ or
+// line end in the lyric starts it again
+void showText(void)
 {
-  while(*p < 128) {
-    ++p;
+  uint8_t len = textQueue[textTail++];
+  uint8_t* line;
+  uint8_t c;
+
+  textTail += 4;
+  if (len & 0x80) {
+    line = screenLine(markerLine);
+    memset(line, 0, 32);
+    for (len &= 0x7F; len; len--) *line++ = ascii_zx(textQueue[textTail++]);
+    return;
+  }
+  line = screenLine(lyricLine);
+  for (; len; len--) {
+    c = textQueue[textTail++];
+    if (c == '/' || c == '\\' || c == '\r' || c == '\n' || lyricCol == 32) {
+      memset(line, 0, 32);
+      lyricCol = 0;
+      if (c == '/' || c == '\\' || c == '\r' || c == '\n') continue;
+    }
+    line[lyricCol++] = ascii_zx(c);
   }
-  return p;
 }
 
-unsigned char* zstrcpy(unsigned char* dest, char* str)
+// Song position as m:ss and a bar for how far through the tracks it is
+void showPosition(void)
 {
-  int n = strlen(str);
-  strcpy(dest, str);
-  cvtcmd(dest);
+  uint8_t* line = screenLine(clockLine);
+  uint8_t minutes = seconds / 60;
+  uint8_t secs = seconds % 60;
+  uint8_t filled, i;
+
+  if (minutes > 9) *line++ = ascii_zx('0' + minutes / 10);
+  *line++ = ascii_zx('0' + minutes % 10);
+  *line++ = ascii_zx(':');
+  *line++ = ascii_zx('0' + secs / 10);
+  *line = ascii_zx('0' + secs % 10);
+
+  filled = miditrack.length ? ((curTrack - 1) * 32 + trackPos() * 32 / miditrack.length) / midiheader.ntracks : 0;
+  line = screenLine(barLine);
+  for (i=0; i<32; i++) line[i] = i < filled ? 0x80 : 0x08;
 }
 
-
-int __FASTCALL__ zxpandCommand(unsigned char* cmdbuf)
+// One small display job, whatever is most due
+void idleDisplay(void)
 {
-  #asm
-  push  hl
-  #endasm
+  uint32_t due;
 
-  #asm
-  pop   de
-  call  $1ff2
-  ld    a,(16445)
-  ld    h,0
-  ld    l,a
-  #endasm
+  if (textTail != textHead) {
+    due = textQueue[(uint8_t)(textTail+1)] | (uint16_t)textQueue[(uint8_t)(textTail+2)] << 8 | (uint32_t)textQueue[(uint8_t)(textTail+3)] << 16 | (uint32_t)textQueue[(uint8_t)(textTail+4)] << 24;
+    if (due <= songMS) {
+      showText();
+      return;
+    }
+  }
+  if (songMS >= nextSecond) {
+    seconds = songMS / 1000;
+    nextSecond = (uint32_t)(seconds + 1) * 1000;
+    showPosition();
+  }
 }
 
-
-void initMidi(void)
+// Wait for the song clock to reach due, doing the display meanwhile.
+// The keys are read here too, so BREAK and P work through a long rest;
+// non zero means stop.
+uint8_t waitUntil(uint32_t due)
 {
-  strcpy(0x8000, "ope mid");
-  cvtcmd(0x8000);
-  zxpandCommand(0x8000);
-  #asm
-  ld    bc,$0007
-  ld    a,1
-  out   (c),a ; prep write
-  #endasm
+  tickClock();
+  while (songMS < due)
+  {
+    idleDisplay();
+    if (keysDown() && handleKeys()) return 1;
+    tickClock();
+  }
+  return 0;
 }
 
-void midiOut(uint8_t x)  __z88dk_fastcall __naked
-{
-  #asm
-  ld    bc,$4007
-  out   (c),l
-  ret
-  #endasm
-}
 
-void flushMidi() __naked
+// Called after a bucket is sent, or while waiting for one, when
+// keysDown(); non zero means stop.
+// A pause releases the sounding notes and waits, the MIDI clock is the song
+// position so nothing needs shifting on resume.
+uint8_t handleKeys(void)
 {
-  #asm
-  ; send data buffer to serial
-  ld    bc,$e007
-  ld    a,$c0
-  out   (c),a
+  uint8_t keys = readKeys();
 
-  ; wait until done
-  call  $1ff6
+  if (keys & keyBreak) return 1;
+  if (!(keys & keyPause)) return 0;
 
-  ; prep write / reset buffer
-  ld    bc,$0007
-  ld    a,1
-  out   (c),a
+  releaseNotes();
+  flushBucket();
+  while (readKeys() & keyPause);
+  while (!(keys = readKeys()));
+  if (keys & keyBreak) return 1;
+  while (readKeys() & keyPause);
 
-  ret
-  #endasm
+  syncClock(millis);
+  restoreControllers();
+  flushBucket();
+  return 0;
 }
 
 
-  union {
-    uint8_t parts[4];
-    uint32_t whole32;
-    uint16_t whole16;
-  } longval;
+// Start on the file opened with "ope fil": read the header chunk and
+// the first track header, so playSong() goes straight into the events
+uint8_t openSong(void)
+{
+  uint8_t err;
 
+  // initMidi() reuses the command buffer, keep the file's for loops
+  memcpy(reopenCmd, 0x8000, 0x80);
 
-// Read a 16 bits integer
-uint16_t read16(void) __z88dk_fastcall
-{
-  longval.parts[1] = SDgetc();
-  longval.parts[0] = SDgetc();
-  return longval.whole16;
-}
+  // Setup MIDI device
+  initMidi();
 
+  resetSong();
+  sdBlock = 0;
+  packedFile = 0;
+  loopRecord = loopReplay = 0;
+  textHead = textTail = lyricCol = 0;
+  seconds = 0;
+  nextSecond = 0;
+  syncClock(0);
+#ifdef PROFILE
+  profReset();
+#endif
 
-// Read a 32 bits integer
-uint32_t read32(void) __z88dk_fastcall
-{
-  longval.parts[3] = SDgetc();
-  longval.parts[2] = SDgetc();
-  longval.parts[1] = SDgetc();
-  longval.parts[0] = SDgetc();
-  return longval.whole32;
-}
+  // Read File header Chunk
+  err = readHeaderChunk();
 
-/*
-// Read a byte but stops if size of the track is excessed
-uint8_t readTrackByte(void) __z88dk_fastcall
-{
-  uint8_t c = 0;
-  if( tpos < miditrack.length )
-  {
-    c = SDgetc();
-    tpos++;
+  // A packed file starts with a 14 byte "MLZ1" header, the same size as
+  // MThd, and then unpacks to the whole original file
+  if (err && midiheader.chk[0]=='M' && midiheader.chk[1]=='L' && midiheader.chk[2]=='Z' && midiheader.chk[3]=='1') {
+    useCompressed();
+    packedFile = 1;
+    err = readHeaderChunk();
   }
-  return c;
-}
-*/
 
-// Read a MIDI "variable length" integer
-uint32_t readVariableLength() __z88dk_fastcall
-{
-  uint32_t v = 0;
-  uint8_t c;
-  //c = readTrackByte();
-  c = SDgetc(); ++tpos;
-  v = c & 0x7F;
-  while( c & 0x80 )
-  {
-    //c = readTrackByte();
-    c = SDgetc(); ++tpos;
-    v = ( v << 7 ) | ( c & 0x7F );
-  }
-  return v;
+  if (!err && midiheader.ntracks) err = readTrackChunk();
+  return err;
 }
 
 
-// Read "midievent.nbdata" bytes in "midievent.data[]" starting at "midievent.data[start]"
-// midievent.nbdata is not limited but we will store only "maxdata" and discard extra data
-uint8_t readNdata( uint8_t start )
+#ifdef PROFILE
+// A bare call, its loop is taken off the SDgetc one
+void profNothing(void) __naked
 {
-  uint32_t i;
-  uint8_t c;
-  for( i=start; i<midievent.nbdata; i++ )
-  {
-    //c = readTrackByte();
-    c = SDgetc(); ++tpos;
-    if( i < maxdata ) midievent.data[i] = c;
-  }
-  return 0;
+  #asm
+  ret
+  #endasm
 }
 
-
-// Send "All Sound Off" message to MIDI out
-void allSoundOff(void)
+// The B setting: every track through SDgetc without playing it, then as
+// many calls to a bare ret, and what a block read and 1000 bytes take on
+// this machine, display and all, for midipack -r and -b.  The difference
+// is SDgetc less its call and ret, 87 T-states a plain byte.  FRAMES
+// counts whole frames, a long song gives the closer figures.
+void benchReads(void)
 {
-  for( uint8_t i=0x00; i<=0x0F; i++ )
+  uint32_t bytes = 0, n;
+  uint32_t frameUS = 1000000 / frameHz;
+  uint16_t start, readFrames, callFrames;
+
+  profReset();
+  start = *frames;
+  for (curTrack=1; curTrack <= midiheader.ntracks; curTrack++)
   {
-    midiOut( 0xB0 | i );  // command: Channel Mode Message
-    midiOut( 0x78 );      // data1:   All sounds Off : 0x78=120
-    midiOut( 0x00 );      // data2:   "0"
-    midiOut( 0xB0 | i );  // command: Channel Mode Message
-    midiOut( 0x7B );      // data1:   All Notes  Off : 0x7B=123
-    midiOut( 0x00 );      // data2:   "0"
+    if (curTrack > 1 && readTrackChunk()) break;
+    for (n=miditrack.length; n; n--) SDgetc();
+    bytes += miditrack.length;
   }
-}
-
+  readFrames = (start - *frames) & 0x7FFF;
 
-// Read MIDI file header Chunk
-uint8_t readHeaderChunk(void)
-{
-  midiheader.chk[0] = SDgetc();
-  midiheader.chk[1] = SDgetc();
-  midiheader.chk[2] = SDgetc();
-  midiheader.chk[3] = SDgetc();
-  midiheader.length   = read32();
-  midiheader.format   = read16();
-  midiheader.ntracks  = read16();
-  midiheader.division = read16();
-
-  tempo = 500000; // Default tempo : 500000 microsec / beat
-
-  if (midiheader.chk[0]=='M' && midiheader.chk[1]=='T' && midiheader.chk[2]=='h' && midiheader.chk[3]=='d' && midiheader.length == 6) {
-    return 0;
-  }
+  start = *frames;
+  for (n=bytes; n; n--) profNothing();
+  callFrames = (start - *frames) & 0x7FFF;
 
-  return badFileheader;
+  printf("%s, %ld bytes, %ld block reads\n", packedFile ? "packed" : "plain", bytes, profCalls[profRefill]);
+  if (profCalls[profRefill]) printf("-r %ld us a block\n", profFrames[profRefill] * frameUS / profCalls[profRefill]);
+  if (bytes >= 1000) printf("-b %ld us a 1000 bytes\n", ((int32_t)readFrames - profFrames[profRefill] - callFrames) * (int32_t)frameUS / (int32_t)(bytes / 1000));
 }
+#endif
 
-
-// Read MIDI file track Chunk
-uint8_t readTrackChunk(void)
+// Play from the first track's events on
+uint8_t playSong(void)
 {
-  miditrack.chk[0] = SDgetc();
-  miditrack.chk[1] = SDgetc();
-  miditrack.chk[2] = SDgetc();
-  miditrack.chk[3] = SDgetc();
-  miditrack.length  = read32();
+  uint8_t err;
 
-  if (miditrack.chk[0]=='M' && miditrack.chk[1]=='T' && miditrack.chk[2]=='r' && miditrack.chk[3]=='k' ) {
-    return 0;
+#ifdef PROFILE
+  if (benchSong) {
+    benchReads();
+    return NoError;
   }
-
-  return badTrackheader;
+#endif
+  err = playTracks();
+
+  if (err == badTrackheader) printf("err reading track chunk");
+  else if (err && err != userStop) printf("err reading track event");
+#ifdef PROFILE
+  profReport();
+#endif
+  return err;
 }
 
 
-// Read MIDI file track event
-uint8_t readTrackEvent(void)
-{
-  uint8_t c;
-  uint32_t ms;
-  // Read time
-  midievent.wait = readVariableLength();
-  // Read track event
-  //midievent.event = readTrackByte();
-  midievent.event = SDgetc(); ++tpos;
-
-  if( midievent.event == 0xFF )
-  {
-    // Meta event
-    // read Meta event type
-    //midievent.mtype = readTrackByte();
-    midievent.mtype = SDgetc(); ++tpos;
-    // read data length
-    midievent.nbdata = readVariableLength();
-    // read data
-    readNdata(0);
-    if( midievent.mtype == MF_Meta_Tempo ) // tempo
-    {
-      tempo = midievent.data[0] * 65536 + midievent.data[1] * 256 + midievent.data[2];
-   }
-  }
-  else if( midievent.event == 0XF0 || midievent.event == 0xF7 )
-  {
-    // SysEx event
-    midievent.nbdata = 0;
-    do
-    {
-      // read one byte
-      //c = readTrackByte();
-      c = SDgetc(); ++tpos;
-      if( midievent.nbdata < maxdata ) midievent.data[midievent.nbdata++] = c;
-    } while( c != 0xF7 && tpos < miditrack.length );
-  }
-  else if( midievent.event & 0x80 )
-  {
-    // Midi event
-    runningEvent = midievent.event;
-    // calculate the number of data bytes
-    midievent.nbdata = ( (midievent.event & 0xE0) == 0xC0 ? 1 : 2 );
-    // Read data bytes
-    readNdata(0);
-  }
-  else
-  {
-    // Running event
-    // transfer first byte from event to data
-    midievent.data[0] = midievent.event;
-    // recall last event value
-    midievent.event = runningEvent;
-    // calculate the number of data bytes
-    midievent.nbdata = ( (runningEvent & 0xE0) == 0xC0 ? 1 : 2 );
-    // Read data bytes (starting from the second one since the first byte is alread in data)
-    readNdata(1);
-  }
+// PLAYLIST
+// A file that isn't MIDI is a playlist: one file name per line, with
+// settings after a comma if it needs them, ending at the end of the
+// file's first 1K or at an empty line.  It is kept at
+// $8400 so the player stays resident and plays the songs back to back.
+#define maxplaylist 1024
+char* playlist = (char*)0x8400;
+char* playlistEnd;
+
 
-  // Calculate next time on which data shall be played
-  ms = ( midievent.wait * tempo ) / midiheader.division / 1000;
-  nextTime += ms;
 
-  // Output to MIDI device
-  if(  midievent.event != 0xFF )
+// openSong() has already read 14 bytes of the list from the first block.
+// The ZXpand doesn't give the player the file length and leaves the rest
+// of the page alone on the last block, so each page is cleared before it
+// is read (main() clears the first): past the end of the file is NUL,
+// which ends the list, rather than what the page held before.
+void loadPlaylist(void)
+{
+  uint16_t n, lineStart = 0;
+  char c;
+
+  for (n=0; n<maxplaylist-1; n++)
   {
-    if (millis != nextTime) {
-      // send queued midi & reset midi buffer
-      flushMidi();
-      //usleep(ms * 1000);
-      millis = nextTime;
+    if (n >= 14 && sdDatIdx == 255) memset(sdData, 0, 256);
+    c = n < 14 ? sdData[n] : SDgetc();
+    if (c == 0 || c == 0x1A || (c & 0x80)) break;
+    if (c == '\n') {
+      // an empty line ends the list
+      if (n == lineStart) break;
+      lineStart = n+1;
+      c = 0;
     }
-    midiOut( midievent.event );
-    for( uint32_t i=0; i<midievent.nbdata && i<maxdata; i++ ) {
-      midiOut( midievent.data[i] );
+    else if (c == '\r') {
+      if (n == lineStart) lineStart++;
+      c = 0;
     }
+    playlist[n] = c;
   }
-  return NoError;
+  playlist[n] = 0;
+  playlistEnd = playlist + n;
 }
 
-
-// Read MIDI file (main part)
-void readMidi(void)
+// Open a file named in ASCII, trying name.mid too
+uint8_t openListed(char* name)
 {
-  uint16_t i;
-  uint8_t err;
+  int retCode;
 
-  // Setup MIDI device
-  initMidi();
+  strcpy(0x8000, "ope fil ");
+  strcat(0x8000, name);
+  cvtcmd(0x8000);
+  retCode = zxpandCommand(0x8000);
+  if (retCode != 0x40) {
+    strcpy(0x8000, "ope fil ");
+    strcat(0x8000, name);
+    strcat(0x8000, ".mid");
+    cvtcmd(0x8000);
+    retCode = zxpandCommand(0x8000);
+  }
+  return retCode == 0x40;
+}
 
-  // Read File header Chunk
-  err = readHeaderChunk();
-  if (err) printf("err reading header chunk");
+// Each song's last bytes are flushed, then the next file is opened and
+// its headers parsed before its first event; only the sounding notes are
+// released in between, never the 96 byte panic
+uint8_t playList(void)
+{
+  char* entry = playlist;
+  char* next;
+  char* settings;
+  uint8_t err;
 
-  // Read succesive Tracks
-  for( i=1; i <= midiheader.ntracks && !err; i++ )
+  for (; entry < playlistEnd; entry = next + 1)
   {
-    // Read track header Chunk
-    err = readTrackChunk();
-   if (err) printf("err reading track chunk");
-
-    // Read succesive Events
-    for( tpos=0; tpos < miditrack.length && !err; ) 
-		{
-			err = readTrackEvent();
-      if (err) printf("err reading track event");
-		}
+    next = entry + strlen(entry);
+    if (!*entry) continue;
+
+    // "name,settings": only rebuild the tables when they change
+    settings = strchr(entry, ',');
+    if (settings) *settings++ = 0;
+    if (settings || songSettings) {
+      defaultSettings();
+      parseSettings(loadSettings);
+      if (settings) parseSettings(settings);
+      buildTransforms();
+    }
+    songSettings = settings != 0;
+
+    usePlain();
+    if (!openListed(entry)) {
+      printf("can't open %s\n", entry);
+      err = 0;
+    }
+    else if (openSong()) {
+      printf("err reading header chunk in %s\n", entry);
+      err = 0;
+    }
+    else {
+      err = playSong();
+      if (err != userStop && waitUntil(millis)) err = userStop;
+      flushBucket();
+      if (err == userStop) return err;
+      releaseNotes();
+      flushBucket();
+    }
   }
+  return NoError;
 }
 
 
 int errorr(const char* errMsg, int code)
 {
     puts(errMsg);
-    puts("example usage: load \"mp:file\"");
+    puts("example usage: load \"mp:file,s120\"");
     return code;
 }
 
@@ -523,7 +515,9 @@ int main( int argc, char** argv )
 {
   int nchars;
   int retCode;
+  uint8_t err, i;
   unsigned char* meta = 16444; // pr_buff
+  unsigned char* p;
 
   memset(0x8000,0,0x80);
 
@@ -539,11 +533,22 @@ int main( int argc, char** argv )
     return errorr("failed to retrieve parameter.", retCode & 0x3f);
   }
 
+  // settings after the first comma, the rest is the file name
+  for (p=(unsigned char*)fname; *p && *p != 26; p++);
+  if (*p) {
+    *p++ = 0;
+    for (i=0; p[i] && i < sizeof(loadSettings)-1; i++) loadSettings[i] = zx_ascii(p[i]);
+    loadSettings[i] = 0;
+  }
+  setupClock();
+  defaultSettings();
+  parseSettings(loadSettings);
+
   terminate(fname);
 
   retCode = zxpandCommand(0x8000);
   if (retCode != 0x40) {
-    unsigned char* p = zstrend(0x8000);
+    p = zstrend(0x8000);
     *p = *p ^ 128;
     p = zstrcpy(p+1, ".mid");
     *p = *p ^ 128;
@@ -554,8 +559,34 @@ int main( int argc, char** argv )
     return errorr("failed to open file", retCode & 0x3f);
   }
 
-  readMidi();
-  allSoundOff();
+  buildTransforms();
 
+  // in case it is a playlist shorter than a block, see loadPlaylist()
+  memset(sdData, 0, 256);
+  err = openSong();
+  if (err == badFileheader && !(midiheader.chk[0]=='M' && midiheader.chk[1]=='T' && midiheader.chk[2]=='h' && midiheader.chk[3]=='d')) {
+    loadPlaylist();
+    err = playList();
+  }
+  else if (err) {
+    printf("err reading header chunk");
+  }
+  else {
+    err = playSong();
+  }
+
+  if (err != userStop && waitUntil(millis)) err = userStop;
+  if (err == userStop) {
+    flushBucket();
+    stopNotes();
+    flushBucket();
+    // 31250 baud, 320us a byte
+    printf("stopped: %d bytes, %d ms\n", stopBytes, (stopBytes * 8) / 25);
+    return 0;
+  }
+
+  flushBucket();
+  allSoundOff();
+  flushBucket();
   return 0;
 }